@@ -87,7 +87,7 @@ typedef struct {
 
 // Derived from AtomDefs.h:
 // Changed entries are commented with "//UNTRUNC:".
-const AtomDefinition KnownAtoms[] = {
+constexpr AtomDefinition KnownAtoms[] = {
   //name    parent atom(s)      container         number                box_type
   {"<()>",  {"_ANY_LEVEL"},     UNKNOWN_ATOM_TYPE, UKNOWN_REQUIREMENTS, UNKNOWN_ATOM },     //our unknown atom (self-defined)
 
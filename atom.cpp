@@ -23,11 +23,27 @@
 #include "atom.h"
 #include "log.h"
 
-#include <map>
 #include <iostream>
+#include <algorithm>
 
 #include <cstring>      //for: memcpy()
 #include <cassert>
+#include <cstdint>
+
+#if defined(__AVX2__)
+# include <immintrin.h>
+#elif defined(__SSSE3__)
+# include <tmmintrin.h>
+#elif defined(__SSE2__)
+# include <emmintrin.h>
+#endif
+
+#ifndef _WIN32
+# include <sys/mman.h>  //for: mmap(), madvise()
+# include <unistd.h>    //for: sysconf()
+// Map the whole file in BufferedAtom instead of reading (and copying) fragments.
+# define BUFFEREDATOM_MMAP 1
+#endif
 
 using namespace std;
 
@@ -69,41 +85,178 @@ static inline void readNE(T &result, const uint8_t *p) {
 }
 
 
-// Atom definitions map.
-static inline uint32_t id2Key(const char *id) {
-	const unsigned char *uid = reinterpret_cast<const unsigned char*>(id);
-	return ((uint32_t(uid[0]) << 24) | (uint32_t(uid[1]) << 16) | (uint32_t(uid[2]) << 8) | uid[3]);
+// Copy n 32 (64) bit values reversing the bytes of each: big endian <-> native (little endian),
+//  the SIMD versions are only compiled on x86. The scalar loop works on any host.
+static void swapCopy32(uint8_t *dest, const uint8_t *source, size_t n) {
+	size_t i = 0;
+#if defined(__AVX2__)
+	const __m256i shuffle256 = _mm256_setr_epi8(3,2,1,0, 7,6,5,4, 11,10,9,8, 15,14,13,12,
+												3,2,1,0, 7,6,5,4, 11,10,9,8, 15,14,13,12);
+	for(; i + 8 <= n; i += 8) {
+		__m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(source + 4*i));
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(dest + 4*i), _mm256_shuffle_epi8(v, shuffle256));
+	}
+#endif
+#if defined(__SSSE3__)
+	const __m128i shuffle = _mm_setr_epi8(3,2,1,0, 7,6,5,4, 11,10,9,8, 15,14,13,12);
+	for(; i + 4 <= n; i += 4) {
+		__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(source + 4*i));
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(dest + 4*i), _mm_shuffle_epi8(v, shuffle));
+	}
+#elif defined(__SSE2__)
+	//swap the bytes of each 16 bit word, then the words.
+	for(; i + 4 <= n; i += 4) {
+		__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(source + 4*i));
+		v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+		v = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, _MM_SHUFFLE(2,3,0,1)), _MM_SHUFFLE(2,3,0,1));
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(dest + 4*i), v);
+	}
+#endif
+	for(; i < n; i++) {
+		uint32_t v = readBE<uint32_t>(source + 4*i);
+		memcpy(dest + 4*i, &v, 4);
+	}
 }
 
-AtomDefinition definition(const char *id) {
-	static const AtomDefinition def_unknown = KnownAtoms[0];
-	static map<uint32_t, AtomDefinition> def;
-	if(def.empty()) {
-		for(unsigned int i = 1; i < sizeof(KnownAtoms)/sizeof(KnownAtoms[0]); ++i) {
-#if 1
-			//for each atom name include the last of multiple definitions
-			def[id2Key(KnownAtoms[i].known_atom_name)] = KnownAtoms[i];
-#else
-			//for each atom name include only the first of multiple definitions
-			def.insert(make_pair(id2Key(KnownAtoms[i].known_atom_name), KnownAtoms[i]));
+static void swapCopy64(uint8_t *dest, const uint8_t *source, size_t n) {
+	size_t i = 0;
+#if defined(__AVX2__)
+	const __m256i shuffle256 = _mm256_setr_epi8(7,6,5,4,3,2,1,0, 15,14,13,12,11,10,9,8,
+												7,6,5,4,3,2,1,0, 15,14,13,12,11,10,9,8);
+	for(; i + 4 <= n; i += 4) {
+		__m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(source + 8*i));
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(dest + 8*i), _mm256_shuffle_epi8(v, shuffle256));
+	}
+#endif
+#if defined(__SSSE3__)
+	const __m128i shuffle = _mm_setr_epi8(7,6,5,4,3,2,1,0, 15,14,13,12,11,10,9,8);
+	for(; i + 2 <= n; i += 2) {
+		__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(source + 8*i));
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(dest + 8*i), _mm_shuffle_epi8(v, shuffle));
+	}
+#elif defined(__SSE2__)
+	for(; i + 2 <= n; i += 2) {
+		__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(source + 8*i));
+		v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+		v = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, _MM_SHUFFLE(0,1,2,3)), _MM_SHUFFLE(0,1,2,3));
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(dest + 8*i), v);
+	}
 #endif
+	for(; i < n; i++) {
+		uint64_t v = readBE<uint64_t>(source + 8*i);
+		memcpy(dest + 8*i, &v, 8);
+	}
+}
+
+
+// Atom definitions map: open addressing hash table built at compile time.
+constexpr uint32_t id2Key(const char *id) {
+	return ((uint32_t(uint8_t(id[0])) << 24) | (uint32_t(uint8_t(id[1])) << 16) | (uint32_t(uint8_t(id[2])) << 8) | uint8_t(id[3]));
+}
+
+constexpr size_t NumKnownAtoms   = sizeof(KnownAtoms)/sizeof(KnownAtoms[0]);
+constexpr size_t DefinitionSlots = 512; //power of 2, at least twice the atoms.
+static_assert(2*NumKnownAtoms <= DefinitionSlots, "Too many atom definitions for the hash table");
+
+constexpr size_t definitionSlot(uint32_t key) {
+	return (key * 2654435761u) >> 23; //top 9 bits of a Fibonacci hash.
+}
+
+struct DefinitionTable {
+	uint32_t keys [DefinitionSlots];
+	uint16_t index[DefinitionSlots]; //in KnownAtoms, 0 (the unknown atom) marks an empty slot.
+	size_t   max_probes;
+};
+
+constexpr DefinitionTable makeDefinitionTable() {
+	DefinitionTable table = {};
+	for(size_t i = 1; i < NumKnownAtoms; ++i) {
+		uint32_t key = id2Key(KnownAtoms[i].known_atom_name);
+		size_t slot = definitionSlot(key);
+		size_t probes = 1;
+		while(table.index[slot] != 0 && table.keys[slot] != key) {
+			slot = (slot + 1) & (DefinitionSlots - 1);
+			probes++;
 		}
+		//for each atom name include the last of multiple definitions
+		table.keys [slot] = key;
+		table.index[slot] = uint16_t(i);
+		if(table.max_probes < probes)
+			table.max_probes = probes;
 	}
+	return table;
+}
 
+constexpr DefinitionTable Definitions = makeDefinitionTable();
+static_assert(Definitions.max_probes <= 4, "Atom definitions hash badly, change definitionSlot()");
+
+const AtomDefinition &definition(const char *id) {
 	if(id) {
-		map<uint32_t, AtomDefinition>::const_iterator it = def.find(id2Key(id));
-		if(it != def.end())
-			return it->second;
+		uint32_t key = id2Key(id);
+		for(size_t slot = definitionSlot(key); Definitions.index[slot] != 0; slot = (slot + 1) & (DefinitionSlots - 1)) {
+			if(Definitions.keys[slot] == key)
+				return KnownAtoms[Definitions.index[slot]];
+		}
 	}
-	return def_unknown;
+	return KnownAtoms[0];
 }
 }; //namespace
 
 
 
+AtomArena::~AtomArena() {
+	for(char *block: blocks)
+		delete[] block;
+}
+
+void *AtomArena::allocate(size_t size, size_t align) {
+	size_t pos = (used + align - 1) & ~(align - 1);
+	if(current && pos + size <= capacity) {
+		used = pos + size;
+		return current + pos;
+	}
+	//big contents get their own block.
+	if(size > BlockSize/4) {
+		char *block = new char[size];
+		blocks.push_back(block);
+		return block;
+	}
+	current  = new char[BlockSize];
+	blocks.push_back(current);
+	capacity = BlockSize;
+	used     = size;
+	return current;
+}
+
+
 Atom::~Atom() {
 	for(unsigned int i = 0; i < children.size(); i++)
-		delete children[i];
+		destroy(children[i]);
+}
+
+Atom *Atom::newTree() {
+	Atom *root = new Atom;
+	root->owned_arena.reset(new AtomArena);
+	root->arena = root->owned_arena.get();
+	return root;
+}
+
+Atom *Atom::create(AtomArena *arena) {
+	if(!arena)
+		return new Atom;
+	Atom *atom = new (arena->allocate(sizeof(Atom), alignof(Atom))) Atom(arena);
+	atom->in_arena = true;
+	return atom;
+}
+
+void Atom::destroy(Atom *atom) {
+	if(!atom)
+		return;
+	//the memory goes with the arena.
+	if(atom->in_arena)
+		atom->~Atom();
+	else
+		delete atom;
 }
 
 
@@ -122,13 +275,14 @@ void Atom::parseHeader(File &file) {
 	}
 }
 
-void Atom::parse(File &file) {
+void Atom::parse(File &file, bool lazy) {
 	parseHeader(file);
 
 	if(isParent(name) && name != string("udta")) { //user data atom is dangerous... i should actually skip all
 		while(file.pos() < start + length) {
-			Atom *atom = new Atom;
-			atom->parse(file);
+			Atom *atom = create(arena);
+			atom->parent = this;
+			atom->parse(file, lazy);
 			children.push_back(atom);
 		}
 		assert(file.pos() == start + length);
@@ -141,31 +295,46 @@ void Atom::parse(File &file) {
 			return;
 		}
 
-		content = file.read(content_size); //length includes header
-		if(content.size() < content_size)
+		if(lazy) {
+			if(file.pos() + content_size > file.length())
+				throw string("Failed reading atom content: ") + name;
+			source        = &file;
+			source_offset = file.pos();
+			source_size   = content_size;
+			file.seek(file.pos() + content_size);
+			return;
+		}
+
+		if(file.pos() + content_size > file.length())
 			throw string("Failed reading atom content: ") + name;
+		content.resize(content_size); //length includes header
+		file.readChar(reinterpret_cast<char *>(content.data()), content_size);
 	}
 }
 
+void Atom::loadContent() {
+	File *file = source;
+	source = nullptr;
+	off_t pos = file->pos();
+	file->seek(source_offset);
+	content.resize(source_size);
+	file->readChar(reinterpret_cast<char *>(content.data()), source_size);
+	file->seek(pos);
+}
+
+// Contents larger than this are written directly instead of copied into the serialization buffer.
+static const size_t MaxSerializedContent = 16<<20;
+
 void Atom::write(File &file) {
-	//1 write length
+	//the whole tree goes out in one write instead of a few per atom.
 #ifndef NDEBUG
 	off_t begin = file.pos();
 #endif
 
-	if(length64) {
-		file.writeInt(1);
-		file.writeChar(name, 4);
-		file.writeInt64(length);
-	} else {
-		file.writeInt(length);
-		file.writeChar(name, 4);
-	}
-
-	if(!content.empty())
-		file.write(content);
-	for(unsigned int i = 0; i < children.size(); i++)
-		children[i]->write(file);
+	vector<unsigned char> out;
+	out.reserve(size_t(std::min<int64_t>(length, MaxSerializedContent)));
+	serialize(file, out);
+	file.write(out);
 
 #ifndef NDEBUG
 	off_t end = file.pos();
@@ -173,6 +342,31 @@ void Atom::write(File &file) {
 #endif
 }
 
+void Atom::serialize(File &file, vector<unsigned char> &out) {
+	load();
+	size_t pos = out.size();
+	if(length64) {
+		out.resize(pos + 16);
+		writeBE<int32_t>(&out[pos], 1);
+		memcpy(&out[pos + 4], name, 4);
+		writeBE<int64_t>(&out[pos + 8], length);
+	} else {
+		out.resize(pos + 8);
+		writeBE<int32_t>(&out[pos], length);
+		memcpy(&out[pos + 4], name, 4);
+	}
+
+	if(content.size() >= MaxSerializedContent) {
+		//not worth a copy (in-memory mdat).
+		file.write(out);
+		out.clear();
+		file.writeChar(reinterpret_cast<const char *>(content.data()), content.size());
+	} else
+		out.insert(out.end(), content.begin(), content.end());
+	for(unsigned int i = 0; i < children.size(); i++)
+		children[i]->serialize(file, out);
+}
+
 int readBits(int n, uint8_t *&buffer, int &offset) {
 	assert(buffer != NULL && offset >= 0);
 	int res = 0;
@@ -397,46 +591,89 @@ void Atom::print(int offset) {
 
 
 bool Atom::isParent(const char *id) {
-	AtomDefinition def = definition(id);
+	const AtomDefinition &def = definition(id);
 	return def.container_state == PARENT_ATOM;// || def.container_state == DUAL_STATE_ATOM;
 }
 
 bool Atom::isDual(const char *id) {
-	AtomDefinition def = definition(id);
+	const AtomDefinition &def = definition(id);
 	return def.container_state == DUAL_STATE_ATOM;
 }
 
 bool Atom::isVersioned(const char *id) {
-	AtomDefinition def = definition(id);
+	const AtomDefinition &def = definition(id);
 	return def.box_type == VERSIONED_ATOM;
 }
 
 
-vector<Atom *> Atom::atomsByName(string name) const {
-	vector<Atom *> atoms;
-	for(unsigned int i = 0; i < children.size(); i++) {
-		if(children[i]->name == name)
-			atoms.push_back(children[i]);
-		vector<Atom *> a = children[i]->atomsByName(name);
-		atoms.insert(atoms.end(), a.begin(), a.end());
-	}
-	return atoms;
+const Atom *Atom::top() const {
+	const Atom *atom = this;
+	while(atom->parent)
+		atom = atom->parent;
+	return atom;
 }
 
-Atom *Atom::atomByName(string name) const {
-	for(unsigned int i = 0; i < children.size(); i++) {
-		if(children[i]->name == name)
-			return children[i];
-		Atom *a = children[i]->atomByName(name);
-		if(a) return a;
+void Atom::buildIndex(Index &index, int &count) const {
+	order = count++;
+	if(order > 0)
+		index[fourcc()].push_back(const_cast<Atom *>(this));
+	for(unsigned int i = 0; i < children.size(); i++)
+		children[i]->buildIndex(index, count);
+	order_end = count;
+}
+
+const vector<Atom *> *Atom::indexed(const char *name) const {
+	const Atom *t = top();
+	if(!t->index) {
+		t->index.reset(new Index);
+		int count = 0;
+		t->buildIndex(*t->index, count);
 	}
+	Index::const_iterator it = t->index->find(fourcc(name));
+	if(it == t->index->end())
+		return NULL;
+	return &it->second;
+}
+
+void Atom::invalidateIndex() {
+	const Atom *t = top();
+	t->index.reset();
+}
+
+vector<Atom *> Atom::atomsByName(const char *name) const {
+	const vector<Atom *> *atoms = indexed(name);
+	if(!atoms)
+		return vector<Atom *>();
+	auto beforeOrder = [](const Atom *a, int order) { return a->order < order; };
+	vector<Atom *>::const_iterator begin = lower_bound(atoms->begin(), atoms->end(), order + 1, beforeOrder);
+	vector<Atom *>::const_iterator end   = lower_bound(begin, atoms->end(), order_end, beforeOrder);
+	return vector<Atom *>(begin, end);
+}
+
+Atom *Atom::atomByName(const char *name) const {
+	const vector<Atom *> *atoms = indexed(name);
+	if(!atoms)
+		return NULL;
+	auto beforeOrder = [](const Atom *a, int order) { return a->order < order; };
+	vector<Atom *>::const_iterator it = lower_bound(atoms->begin(), atoms->end(), order + 1, beforeOrder);
+	if(it != atoms->end() && (*it)->order < order_end)
+		return *it;
 	return NULL;
 }
 
+void Atom::addChild(Atom *child) {
+	child->parent = this;
+	children.push_back(child);
+	invalidateIndex();
+}
+
 void Atom::replace(Atom *original, Atom *replacement) {
 	for(unsigned int i = 0; i < children.size(); i++) {
 		if(children[i] == original) {
 			children[i] = replacement;
+			original->parent = nullptr;
+			replacement->parent = this;
+			invalidateIndex();
 			return;
 		}
 	}
@@ -444,16 +681,18 @@ void Atom::replace(Atom *original, Atom *replacement) {
 }
 
 
-void Atom::prune(string name) {
+void Atom::prune(const char *name) {
 	if(children.empty()) return;
 
 	length = 8;
 
+	uint32_t key = fourcc(name);
 	vector<Atom *>::iterator it = children.begin();
 	while(it != children.end()) {
 		Atom *child = *it;
-		if(name == child->name) {
-			delete child;
+		if(child->fourcc() == key) {
+			invalidateIndex();
+			destroy(child);
 			it = children.erase(it);
 		} else {
 			child->prune(name);
@@ -465,7 +704,7 @@ void Atom::prune(string name) {
 
 void Atom::updateLength() {
 	length = 8;
-	length += content.size();
+	length += contentSize();
 	if(length >= 1L<<32) {
 		length64 = true;
 		length += 8;
@@ -480,48 +719,97 @@ void Atom::updateLength() {
 
 
 void Atom::contentResize(size_t newsize) {
+	load();
+	//the arena never frees, so a table growing on save moves to the heap where the old buffer can go.
+	if(content.get_allocator().arena && newsize > content.capacity()) {
+		std::vector<unsigned char, ArenaAllocator<unsigned char> > grown;
+		grown.reserve(newsize);
+		grown.assign(content.begin(), content.end());
+		content = std::move(grown);
+	}
 	content.resize(newsize);
 }
 
 uint8_t Atom::readUInt8(int64_t offset) {
+	load();
 	return uint8_t(content[offset]);
 }
 
 int16_t Atom::readInt16(int64_t offset) {
+	load();
 	assert(offset >= 0 && content.size() >= uint64_t(offset) + 2);
 	return readBE<int16_t>(&content[offset]);
 
 }
 
 int32_t Atom::readInt(int64_t offset) {
+	load();
 	assert(offset >= 0 && content.size() >= uint64_t(offset) + 4);
 	return readBE<int32_t>(&content[offset]);
 }
 
 
 uint32_t Atom::readUInt(int64_t offset) {
+	load();
 	assert(offset >= 0 && content.size() >= uint64_t(offset) + 4);
 	return readBE<uint32_t>(&content[offset]);
 }
 
 int64_t Atom::readInt64(int64_t offset) {
+	load();
 	assert(offset >= 0 && content.size() >= uint64_t(offset) + 8);
 	return readBE<int64_t>(&content[offset]);
 }
 
 void Atom::writeInt(int32_t value, int64_t offset) {
+	load();
 	assert(offset >= 0 && content.size() >= uint64_t(offset) + 4);
 	writeBE(&content[offset], value);
 }
 
 void Atom::writeInt64(int64_t value, int64_t offset) {
+	load();
 	assert(offset >= 0 && content.size() >= uint64_t(offset) + 8);
 	writeBE(&content[offset], value);
 }
 
 
+void Atom::readInts(int64_t offset, int32_t *dest, size_t n) {
+	load();
+	if(offset < 0 || uint64_t(offset) + 4*uint64_t(n) > content.size())
+		throw string("Table out of atom: ") + name;
+	if(n)
+		swapCopy32(reinterpret_cast<uint8_t *>(dest), &content[offset], n);
+}
+
+void Atom::readInt64s(int64_t offset, int64_t *dest, size_t n) {
+	load();
+	if(offset < 0 || uint64_t(offset) + 8*uint64_t(n) > content.size())
+		throw string("Table out of atom: ") + name;
+	if(n)
+		swapCopy64(reinterpret_cast<uint8_t *>(dest), &content[offset], n);
+}
+
+void Atom::writeInts(int64_t offset, const int32_t *source, size_t n) {
+	load();
+	if(offset < 0 || uint64_t(offset) + 4*uint64_t(n) > content.size())
+		throw string("Table out of atom: ") + name;
+	if(n)
+		swapCopy32(&content[offset], reinterpret_cast<const uint8_t *>(source), n);
+}
+
+void Atom::writeInt64s(int64_t offset, const int64_t *source, size_t n) {
+	load();
+	if(offset < 0 || uint64_t(offset) + 8*uint64_t(n) > content.size())
+		throw string("Table out of atom: ") + name;
+	if(n)
+		swapCopy64(&content[offset], reinterpret_cast<const uint8_t *>(source), n);
+}
+
+
 uint8_t *Atom::data(uint8_t *str, int64_t offset, int64_t length) {
 	assert(str != NULL);
+	load();
 	assert(offset >= 0 && length >= 0 && content.size() >= uint64_t(offset) + uint64_t(length));
 	return &content[offset];
 }
@@ -530,6 +818,7 @@ uint8_t *Atom::data(uint8_t *str, int64_t offset, int64_t length) {
 
 void Atom::readChar(char *str, int64_t offset, int64_t length) {
 	assert(str != NULL);
+	load();
 	assert(offset >= 0 && length >= 0 && content.size() >= uint64_t(offset) + uint64_t(length));
 	const unsigned char *p = &content[offset];
 	for(long int i = 0; i < length; i++)
@@ -540,20 +829,73 @@ void Atom::readChar(char *str, int64_t offset, int64_t length) {
 
 
 // BufferedAtom
+const int64_t BufferedAtom::MinWindowSize = 1<<20;
+
 BufferedAtom::BufferedAtom(string filename)
 	: file_begin(0),
 	  file_end(0),
 	  buffer(NULL),
 	  buffer_begin(0),
-	  buffer_end(0)
+	  buffer_end(0),
+	  buffer_capacity(0),
+	  mapped(NULL),
+	  mapped_size(0),
+	  owns_map(true),
+	  advised_end(0),
+	  readahead(default_readahead),
+	  filename(filename)
 {
 	if(!file.open(filename))
 		throw string("Could not open file");
 	file_end = file.length();
+
+#ifdef BUFFEREDATOM_MMAP
+	//fragments become pointers into the mapping: no allocation, no copy.
+	//if mapping fails (some network filesystems, 32 bit address space) we fall back to reading.
+	if(file_end > 0 && uint64_t(file_end) <= SIZE_MAX) {
+		void *map = mmap(NULL, size_t(file_end), PROT_READ, MAP_SHARED, file.descriptor(), 0);
+		if(map != MAP_FAILED) {
+			mapped      = static_cast<unsigned char *>(map);
+			mapped_size = file_end;
+			//the repair scan moves (almost) strictly forward.
+			madvise(map, size_t(mapped_size), MADV_SEQUENTIAL);
+		} else {
+			Log::debug << "Could not map " << filename << " in memory, reading fragments instead.\n";
+		}
+	}
+#endif
+}
+
+//the mapping is only read, so parallel walks can share it (shared must outlive this atom).
+BufferedAtom::BufferedAtom(BufferedAtom *shared)
+	: file_begin(shared->file_begin),
+	  file_end(shared->file_end),
+	  buffer(NULL),
+	  buffer_begin(0),
+	  buffer_end(0),
+	  buffer_capacity(0),
+	  mapped(shared->mapped),
+	  mapped_size(shared->mapped_size),
+	  owns_map(false),
+	  advised_end(0),
+	  readahead(shared->readahead),
+	  filename(shared->filename)
+{
+	start = shared->start;
+	memcpy(name, shared->name, 5);
+	content_start = shared->content_start;
+	if(!mapped && !file.open(filename))
+		throw string("Could not open file");
 }
 
 BufferedAtom::~BufferedAtom() {
+	for(Prefetch &prefetch: ahead)
+		waitPrefetch(prefetch);
 	delete[] buffer;
+#ifdef BUFFEREDATOM_MMAP
+	if(mapped && owns_map)
+		munmap(mapped, size_t(mapped_size));
+#endif
 }
 
 
@@ -564,30 +906,158 @@ unsigned char *BufferedAtom::getFragment(int64_t offset, int64_t size) {
 	if(offset >= file_end)
 		throw string("Out of buffer");
 	if(offset + size > file_end - file_begin)
-		size = file_end - offset;
+		size = file_end - file_begin - offset;
+
+	if(mapped && file_begin + offset + size <= mapped_size) {
+		adviseAhead(file_begin + offset + size);
+		return mapped + file_begin + offset;
+	}
 
-	if(buffer) {
-		if(buffer_begin <= offset && buffer_end >= offset + size)
-			return buffer + (offset - buffer_begin);
+	if(buffer && buffer_begin <= offset && buffer_end >= offset + size)
+		return buffer + (offset - buffer_begin);
 
-		//reallocate and reread
-		flush();
+	//the window is allocated once and only grows when a larger fragment is requested.
+	if(!buffer || buffer_capacity < 2 * size) {
+		delete[] buffer;
+		buffer_capacity = std::max(2 * size, MinWindowSize);
+		buffer = new unsigned char[buffer_capacity];
+		buffer_begin = buffer_end = 0;
 	}
 
-	buffer_begin = offset;
-	buffer_end   = offset + 2 * size;
-	if(buffer_end + file_begin > file_end)
-		buffer_end = file_end - file_begin;
-	buffer = new unsigned char[buffer_end - buffer_begin];
-	file.seek(file_begin + buffer_begin);
-	file.readChar((char *)buffer, buffer_end - buffer_begin);
-	return buffer;
+	//slide the window forward, keeping a margin behind offset for short backtracks.
+	int64_t margin = std::min(offset, std::min(buffer_capacity / 8, buffer_capacity - size));
+	int64_t begin  = offset - margin;
+	int64_t end    = std::min(begin + buffer_capacity, file_end - file_begin);
+
+	//move the part we already have in place and read only what is missing.
+	int64_t keep_begin = std::max(begin, buffer_begin);
+	int64_t keep_end   = std::min(end, buffer_end);
+	if(keep_begin < keep_end) {
+		memmove(buffer + (keep_begin - begin), buffer + (keep_begin - buffer_begin), keep_end - keep_begin);
+		readWindow(begin, begin, keep_begin);
+		readWindow(begin, keep_end, end);
+	} else {
+		readWindow(begin, begin, end);
+	}
+	buffer_begin = begin;
+	buffer_end   = end;
+	startPrefetch(file_begin + buffer_end);
+	return buffer + (offset - buffer_begin);
 }
-void BufferedAtom::flush() {
-	if(buffer) {
-		delete []buffer;
-		buffer = nullptr;
+
+void BufferedAtom::readWindow(int64_t window_begin, int64_t from, int64_t to) {
+	//take what the read-ahead threads already fetched.
+	bool found = true;
+	while(from < to && found) {
+		found = false;
+		int64_t pos = file_begin + from;
+		for(Prefetch &prefetch: ahead) {
+			if(pos < prefetch.begin || pos >= prefetch.end)
+				continue;
+			waitPrefetch(prefetch);
+			if(pos < prefetch.begin || pos >= prefetch.end) //the read failed.
+				continue;
+			int64_t n = std::min(file_begin + to, prefetch.end) - pos;
+			memcpy(buffer + (from - window_begin), &prefetch.data[pos - prefetch.begin], n);
+			from += n;
+			found = true;
+			break;
+		}
 	}
+	if(from >= to)
+		return;
+	file.seek(file_begin + from);
+	file.readChar((char *)buffer + (from - window_begin), to - from);
+}
+
+// Read-ahead (bytes), 0 disables it.
+int64_t BufferedAtom::default_readahead = 32<<20;
+
+void BufferedAtom::startPrefetch(int64_t pos) {
+	if(readahead <= 0)
+		return;
+	//the buffer just after pos, then the one after it.
+	for(int k = 0; k < 2; k++) {
+		bool covered = false;
+		for(Prefetch &prefetch: ahead) {
+			if(prefetch.begin <= pos && pos < prefetch.end) {
+				pos = prefetch.end;
+				covered = true;
+			}
+		}
+		if(covered)
+			continue;
+
+		int64_t end = std::min(pos + readahead, file_end);
+		if(pos >= end)
+			return;
+
+		//reuse a buffer we are past (or far behind of), but don't stall the matcher waiting for one.
+		Prefetch *slot = NULL;
+		for(Prefetch &prefetch: ahead) {
+			bool busy = prefetch.pending.valid() &&
+				prefetch.pending.wait_for(std::chrono::seconds(0)) != std::future_status::ready;
+			if(!busy && (prefetch.end <= pos || prefetch.begin >= pos + 2*readahead)) {
+				slot = &prefetch;
+				break;
+			}
+		}
+		if(!slot)
+			return;
+		waitPrefetch(*slot);
+
+		if(!slot->file) {
+			slot->file.reset(new File);
+			if(!slot->file->open(filename)) {
+				Log::debug << "Could not open " << filename << " for read-ahead.\n";
+				readahead = 0;
+				return;
+			}
+		}
+		slot->data.resize(end - pos);
+		slot->begin = pos;
+		slot->end   = end;
+		File *file = slot->file.get();
+		unsigned char *data = &slot->data[0];
+		slot->pending = std::async(std::launch::async, [file, data, pos, end]() {
+			file->seek(pos);
+			file->readChar((char *)data, end - pos);
+		});
+		pos = end;
+	}
+}
+
+void BufferedAtom::waitPrefetch(Prefetch &prefetch) {
+	if(!prefetch.pending.valid())
+		return;
+	try {
+		prefetch.pending.get();
+	} catch(string) {
+		prefetch.begin = prefetch.end = 0;
+	}
+}
+
+void BufferedAtom::adviseAhead(int64_t pos) {
+#ifdef BUFFEREDATOM_MMAP
+	if(readahead <= 0)
+		return;
+	//restart after a large jump back.
+	if(pos + 2*readahead < advised_end)
+		advised_end = pos;
+	if(pos + readahead/2 < advised_end)
+		return;
+	//the kernel reads the pages asynchronously, like a read-ahead thread would.
+	static const int64_t page_size = sysconf(_SC_PAGESIZE);
+	int64_t begin = std::max(pos, advised_end) & ~(page_size - 1);
+	int64_t end   = std::min(pos + readahead, std::min(mapped_size, file_end));
+	if(begin < end)
+		madvise(mapped + begin, size_t(end - begin), MADV_WILLNEED);
+	advised_end = pos + readahead;
+#endif
+}
+
+void BufferedAtom::flush() {
+	//keep the allocation around, just forget the content.
 	buffer_begin = buffer_end = 0;
 }
 
@@ -614,20 +1084,29 @@ void BufferedAtom::contentResize(size_t newsize) {
 
 
 int32_t BufferedAtom::readInt(int64_t offset) {
-	if(!buffer || offset < buffer_begin || offset > (buffer_end - 4)) {
-		buffer = getFragment(offset, 1<<16);
-	}
+	if(mapped)
+		return readNE<int32_t>(getFragment(offset, 4));
+	if(!buffer || offset < buffer_begin || offset > (buffer_end - 4))
+		getFragment(offset, 1<<16);
 	return readNE<int32_t>(buffer + offset - buffer_begin);
 }
 
 int64_t BufferedAtom::readInt64(int64_t offset) {
-	if(!buffer || offset < buffer_begin || offset > (buffer_end - 8)) {
-		buffer = getFragment(offset, 1<<16);
-	}
+	if(mapped)
+		return readNE<int64_t>(getFragment(offset, 8));
+	if(!buffer || offset < buffer_begin || offset > (buffer_end - 8))
+		getFragment(offset, 1<<16);
 	return readNE<int64_t>(buffer + offset - buffer_begin);
 }
 
 
+void BufferedAtom::serialize(File &file, vector<unsigned char> &out) {
+	//mdat content stays on disk: write what we have so far and copy.
+	file.write(out);
+	out.clear();
+	write(file);
+}
+
 void BufferedAtom::write(File &output) {
 	//1 write length
 #ifndef NDEBUG
@@ -643,17 +1122,10 @@ void BufferedAtom::write(File &output) {
 		output.writeChar(name, 4);
 	}
 
-	char buff[1<<20];
-	int64_t offset = file_begin;
-	file.seek(file_begin);
-	while(offset < file_end) {
-		int64_t toread = 1<<20;
-		if(toread + offset > file_end)
-			toread = file_end - offset;
-		file.readChar(buff, toread);
-		offset += toread;
-		output.writeChar(buff, toread);
-	}
+	//the kernel does the copy (see File::copy).
+	if(output.copy(file, file_begin, file_end - file_begin) != file_end - file_begin)
+		throw string("Could not copy mdat content");
+
 	for(unsigned int i = 0; i < children.size(); i++)
 		children[i]->write(output);
 
@@ -27,10 +27,115 @@ extern "C" {
 }
 #include <vector>
 #include <string>
+#include <memory>
+#include <future>
+#include <unordered_map>
+#include <iterator>
+#include <type_traits>
 
 #include "file.h"
 
 
+// Bump allocator for the atoms of a tree and their content: nothing is freed
+// until the arena itself is destroyed, then everything goes at once.
+class AtomArena {
+public:
+	AtomArena() {}
+	~AtomArena();
+
+	void *allocate(size_t size, size_t align);
+
+protected:
+	static const size_t BlockSize = 1<<20;
+	std::vector<char *> blocks;
+	char  *current = nullptr;
+	size_t used = 0;
+	size_t capacity = 0;
+
+private:
+	AtomArena(const AtomArena&);
+	AtomArena& operator=(const AtomArena&);
+};
+
+// Allocates from an arena if given one, from the heap otherwise.
+template<class T>
+class ArenaAllocator {
+public:
+	typedef T value_type;
+	//contentResize moves grown tables to the heap by assigning a heap vector.
+	typedef std::true_type propagate_on_container_move_assignment;
+	AtomArena *arena;
+
+	ArenaAllocator(AtomArena *arena = nullptr) noexcept : arena(arena) {}
+	template<class U>
+	ArenaAllocator(const ArenaAllocator<U> &a) noexcept : arena(a.arena) {}
+
+	T *allocate(size_t n) {
+		if(arena)
+			return static_cast<T *>(arena->allocate(n*sizeof(T), alignof(T)));
+		return std::allocator<T>().allocate(n);
+	}
+	void deallocate(T *p, size_t n) noexcept {
+		if(!arena)
+			std::allocator<T>().deallocate(p, n);
+	}
+	template<class U>
+	bool operator==(const ArenaAllocator<U> &a) const { return arena == a.arena; }
+	template<class U>
+	bool operator!=(const ArenaAllocator<U> &a) const { return arena != a.arena; }
+};
+
+
+// Read only view of a big endian table inside an atom content (no copy):
+//  valid until the content is resized or the atom destroyed.
+template<class T>
+class BigEndianTable {
+public:
+	class const_iterator {
+	public:
+		typedef std::random_access_iterator_tag iterator_category;
+		typedef T value_type;
+		typedef ptrdiff_t difference_type;
+		typedef const T *pointer;
+		typedef T reference;
+
+		const_iterator(const uint8_t *p): p(p) {}
+		T operator*() const { return BigEndianTable::read(p); }
+		T operator[](difference_type i) const { return BigEndianTable::read(p + i*sizeof(T)); }
+		const_iterator &operator++() { p += sizeof(T); return *this; }
+		const_iterator &operator--() { p -= sizeof(T); return *this; }
+		const_iterator &operator+=(difference_type i) { p += i*sizeof(T); return *this; }
+		const_iterator operator+(difference_type i) const { return const_iterator(p + i*sizeof(T)); }
+		difference_type operator-(const const_iterator &it) const { return (p - it.p)/difference_type(sizeof(T)); }
+		bool operator==(const const_iterator &it) const { return p == it.p; }
+		bool operator!=(const const_iterator &it) const { return p != it.p; }
+		bool operator<(const const_iterator &it) const { return p < it.p; }
+	protected:
+		const uint8_t *p;
+	};
+
+	BigEndianTable() {}
+	BigEndianTable(const uint8_t *data, size_t n): data(data), n(n) {}
+
+	size_t size() const { return n; }
+	bool empty() const { return n == 0; }
+	T operator[](size_t i) const { return read(data + i*sizeof(T)); }
+	const_iterator begin() const { return const_iterator(data); }
+	const_iterator end() const { return const_iterator(data + n*sizeof(T)); }
+
+	static T read(const uint8_t *p) {
+		typename std::make_unsigned<T>::type v = 0;
+		for(size_t i = 0; i < sizeof(T); i++)
+			v = (v << 8) | p[i];
+		return T(v);
+	}
+
+protected:
+	const uint8_t *data = nullptr;
+	size_t n = 0;
+};
+
+
 class Atom {
 public:
 	int64_t start = 0;       //including 8 header bytes
@@ -39,27 +144,44 @@ public:
     char    name[5] = "";
     char    head[4] = "";
     char    version[4] = "";
-    std::vector<unsigned char> content;
-    std::vector<Atom *> children;
+    std::vector<unsigned char, ArenaAllocator<unsigned char> > content;
+    std::vector<Atom *> children; //use addChild to keep the index valid.
+	Atom   *parent = nullptr;
 	bool length64 = false;
+	AtomArena *arena = nullptr; //children and their content are allocated here (NULL: heap).
 
 	Atom() {};
+	explicit Atom(AtomArena *arena): content(ArenaAllocator<unsigned char>(arena)), arena(arena) {}
     virtual ~Atom();
 
+	static Atom *newTree();              //root owning an arena for the whole tree.
+	static Atom *create(AtomArena *arena); //heap if arena is NULL.
+	static void  destroy(Atom *atom);    //use instead of delete, atom might live in an arena.
+
     void parseHeader  (File &file); //read just name and length
-    void parse        (File &file);
+    void parse        (File &file, bool lazy = false); //lazy: content is read on first access, file must stay open.
     virtual void write(File &file);
+    //append the atom to out, flushing out to file first if the atom can't be held in memory.
+    virtual void serialize(File &file, std::vector<unsigned char> &out);
     void print(int offset);
 
-    std::vector<Atom *> atomsByName(std::string name) const;
-    Atom *              atomByName (std::string name) const;
+    //descendants in depth first order, looked up in an index kept by the top atom.
+    std::vector<Atom *> atomsByName(const char *name) const;
+    Atom *              atomByName (const char *name) const;
+    void addChild(Atom *child);
     void replace(Atom *original, Atom *replacement);
 
-    void prune(std::string name);
+    void prune(const char *name);
     virtual void updateLength();
 
-    virtual int64_t contentSize() const { return content.size();   }
-    virtual void    contentResize(size_t newsize); //unused!
+    virtual int64_t contentSize() const { return source ? source_size : content.size(); }
+    virtual void    contentResize(size_t newsize);
+
+    static uint32_t fourcc(const char *id) {
+        const unsigned char *u = reinterpret_cast<const unsigned char *>(id);
+        return (uint32_t(u[0]) << 24) | (uint32_t(u[1]) << 16) | (uint32_t(u[2]) << 8) | uint32_t(u[3]);
+    }
+    uint32_t fourcc() const { return fourcc(name); }
 
     static bool isParent   (const char *id);
     static bool isDual     (const char *id);
@@ -73,9 +195,44 @@ public:
     virtual int64_t readInt64(int64_t offset);
     void writeInt  (int32_t value, int64_t offset);
     void writeInt64(int64_t value, int64_t offset);
+	//view of n big endian values starting at offset, throw if out of the content.
+	template<class T>
+	BigEndianTable<T> table(int64_t offset, size_t n) {
+		load();
+		if(offset < 0 || uint64_t(offset) + sizeof(T)*uint64_t(n) > content.size())
+			throw std::string("Table out of atom: ") + name;
+		return BigEndianTable<T>(n ? &content[offset] : nullptr, n);
+	}
+	//whole big endian tables of n values starting at offset, throw if out of the content.
+	void readInts   (int64_t offset, int32_t *dest, size_t n);
+	void readInt64s (int64_t offset, int64_t *dest, size_t n);
+	void writeInts  (int64_t offset, const int32_t *source, size_t n);
+	void writeInt64s(int64_t offset, const int64_t *source, size_t n);
 	uint8_t *data(uint8_t *str, int64_t offset, int64_t length);
 	void readChar(char *str, int64_t offset, int64_t length);
 
+protected:
+	File   *source = nullptr; //content not loaded yet: it's in source at source_offset.
+	int64_t source_offset = 0;
+	int64_t source_size = 0;
+
+	void load() { if(source) loadContent(); }
+	void loadContent();
+
+	std::unique_ptr<AtomArena> owned_arena; //only the root of the tree.
+	bool in_arena = false;
+
+	//fourcc -> atoms in depth first order, built on the top atom at first lookup.
+	typedef std::unordered_map<uint32_t, std::vector<Atom *> > Index;
+	mutable std::unique_ptr<Index> index;
+	mutable int order = 0;     //depth first position, descendants are in (order, order_end).
+	mutable int order_end = 0;
+
+	const Atom *top() const;
+	const std::vector<Atom *> *indexed(const char *name) const;
+	void buildIndex(Index &index, int &count) const;
+	void invalidateIndex();
+
 private:
     // Disable copying (BufferedAtom can't be copied, so children can't either).
     Atom(const Atom&);
@@ -89,11 +246,16 @@ public:
     int64_t file_end;
 	File    file; //don't touch!
 
+	static int64_t default_readahead; //bytes read in background past the current window.
+
     explicit BufferedAtom(std::string filename);
+    explicit BufferedAtom(BufferedAtom *shared); //same content, reusing its mapping if any.
     ~BufferedAtom();
 
     virtual void write(File &file);
+    virtual void serialize(File &file, std::vector<unsigned char> &out);
 
+    //returned pointer is valid until the next call.
     unsigned char *getFragment(int64_t offset, int64_t size);
 	void flush();
     virtual void updateLength();
@@ -111,6 +273,30 @@ protected:
 	unsigned char  *buffer;
     int64_t         buffer_begin;
     int64_t         buffer_end;
+	int64_t         buffer_capacity; //sliding window used when the file is not mapped.
+	unsigned char  *mapped;      //whole file when memory mapped, NULL if reading fragments.
+	int64_t         mapped_size;
+	bool            owns_map;    //false if the mapping belongs to the atom this one was shared from.
+	int64_t         advised_end;
+	int64_t         readahead;   //default_readahead, 0 once the read-ahead can't open the file.
+
+	//read-ahead: two buffers, each filled by a background thread with its own file handle,
+	//so the next one is being read while the current one is consumed.
+	struct Prefetch {
+		std::unique_ptr<File>      file;
+		std::vector<unsigned char> data;
+		int64_t                    begin = 0; //absolute file positions.
+		int64_t                    end   = 0;
+		std::future<void>          pending;
+	};
+	std::string filename;
+	Prefetch    ahead[2];
+
+	static const int64_t MinWindowSize;
+	void readWindow(int64_t window_begin, int64_t from, int64_t to);
+	void startPrefetch(int64_t pos);
+	void waitPrefetch(Prefetch &prefetch);
+	void adviseAhead(int64_t pos);
 
 private:
     // Disable copying (File can't be copied).
@@ -15,6 +15,36 @@ using namespace std;
 
 
 // Codec.
+
+//match and search functions by codec name, anything else is matched as pcm or unknown.
+struct CodecFunctions {
+	const char *name;
+	Codec::MatchFunction match;
+	Codec::SearchFunction search;
+	int cost;
+	float max_chances; //the highest chances match can return.
+};
+
+static const float Unbounded = numeric_limits<float>::infinity(); //chances from the stats of the working file.
+
+static const CodecFunctions KnownCodecs[] = {
+	{ "rtp ", &Codec::rtpTrackMatch, nullptr, 1, Unbounded },
+	{ "avc1", &Codec::avc1Match, &Codec::avc1Search, 2, Unbounded },
+	{ "mp4a", &Codec::mp4aMatch, &Codec::mp4aSearch, 2, 100 },
+	{ "mp4v", &Codec::mp4vMatch, &Codec::mp4vSearch, 2, 1<<20 },
+	{ "hev1", &Codec::hev1Match, nullptr, 1, 1e10 },
+	{ "hvc1", &Codec::hev1Match, nullptr, 1, 1e10 },
+	{ "alac", &Codec::alacMatch, nullptr, 2, 10000 },
+	{ "mebx", &Codec::mbexMatch, nullptr, 0, 1e10/200.0f*1e10 },
+	{ "text", &Codec::textMatch, nullptr, 0, Unbounded },
+	{ "apch", &Codec::apchMatch, &Codec::apchSearch, 0, 1e30 },
+	{ "tmcd", &Codec::tmcdMatch, nullptr, 0, 1024 },
+	{ "gpmd", &Codec::gpmdMatch, &Codec::gpmdSearch, 0, 1<<20 },
+	{ "camm", &Codec::cammMatch, &Codec::gpmdSearch, 0, 1<<20 }, //same packet structure.
+	{ "fdsc", &Codec::fdscMatch, &Codec::fdscSearch, 0, 1<<20 },
+	{ "priv", &Codec::mijdMatch, nullptr, 0, 1e30 },
+};
+
 Codec::Codec() : context(NULL), codec(NULL), mask1(0), mask0(0) { }
 
 void Codec::clear() {
@@ -23,6 +53,9 @@ void Codec::clear() {
 	codec   = NULL;
 	mask1   = 0;
 	mask0   = 0;
+	match_function  = &Codec::unknownMatch;
+	search_function = nullptr;
+	max_chances     = Unbounded;
 }
 
 bool Codec::parse(Atom *trak) {
@@ -72,75 +105,29 @@ bool Codec::parse(Atom *trak) {
 		}
 
 	}
+
+	match_function = pcm ? &Codec::pcmMatch : &Codec::unknownMatch; //rtmd
+	search_function = nullptr;
+	cost = 0;
+	max_chances = pcm ? 2.0f : Unbounded;
+	for(const CodecFunctions &known: KnownCodecs) {
+		if(name == known.name) {
+			match_function = known.match;
+			search_function = known.search;
+			cost = known.cost;
+			max_chances = known.max_chances;
+			break;
+		}
+	}
 	return true;
 }
 
 //Match rtpMatch(const unsigned char *start, int maxlength);
 
 
-Match Codec::match(const unsigned char *start, int maxlength) {
-
-	if(name == "rtp ") {
-		return rtpMatch(start, maxlength);
-	} else if(name == "avc1") {
-		return avc1Match(start, maxlength);
-
-	} else if(name == "mp4a") {
-		return mp4aMatch(start, maxlength);
-	} else if(name == "mp4v") {
-		return mp4vMatch(start, maxlength);
-
-	} else if(name == "hev1" || name == "hvc1") {
-		return hev1Match(start, maxlength);
-
-	} else if(name == "alac") {
-		return alacMatch(start, maxlength);
-	} else if(name == "mebx") {
-		return mbexMatch(start, maxlength);
-	} else if(name == "text") {
-		return textMatch(start, maxlength);
-	} else if(name == "apch") {
-		return apchMatch(start, maxlength);
-	} else if(name == "tmcd") {
-		return tmcdMatch(start, maxlength);		
-	} else if(name == "gpmd") {
-		return gpmdMatch(start, maxlength);
-	} else if(name == "camm") {
-		return cammMatch(start, maxlength);
-
-
-	} else if(name == "fdsc") {
-		return fdscMatch(start, maxlength);
-	} else if(name == "priv") {
-		return mijdMatch(start, maxlength);
-	} else if(pcm) {
-		return pcmMatch(start, maxlength);
-	} else { //rtmd
-		return unknownMatch(start, maxlength);
-	}
-
-
-	Log::error << "Unsupported codec: " << name << "\n";
-	return Match();
-	//throw "Usnupported codec\n";
-}
-
 Match Codec::search(const unsigned char *start, int maxlength, int maxskip) {
-	if(name == "apch") {
-		return apchSearch(start, maxlength, maxskip);
-	} else if(name == "avc1") {
-		return avc1Search(start, maxlength, maxskip);
-	} else if(name == "mp4a") {
-		return mp4aSearch(start, maxlength, maxskip);
-	} else if(name == "mp4v") {
-		return mp4vSearch(start, maxlength, maxskip);
-	} else if(name == "gpmd") {
-		return gpmdSearch(start, maxlength, maxskip);
-	} else if(name == "camm") {
-		return gpmdSearch(start, maxlength, maxskip);
-	} else if(name == "fdsc") {
-		return fdscSearch(start, maxlength, maxskip);
-	}
+	if(search_function)
+		return (this->*search_function)(start, maxlength, maxskip);
 
 	Match match;
 	return match;
@@ -3,6 +3,7 @@
 
 #include <string>
 #include <vector>
+#include <limits>
 
 #include "codecstats.h"
 
@@ -39,6 +40,8 @@ public:
 	uint32_t pcm_bytes_per_sample = 0; //sample size.
 	bool pcm = false;
 	bool tmcd_seen = false;
+	int cost = 0; //of match: 0 header checks, 1 parsing the packet, 2 decoding with libav.
+	float max_chances = std::numeric_limits<float>::infinity(); //no match can be surer (infinity if it depends on stats).
 //	bool knows_start = false;
 //	bool guess_start = false;
 //	bool knows_length = false;
@@ -50,11 +53,20 @@ public:
 	bool parse(Atom *trak);
 	void clear();
 
-	Match match(const unsigned char *start, int maxlength);
+	typedef Match (Codec::*MatchFunction)(const unsigned char *start, int maxlength);
+	typedef Match (Codec::*SearchFunction)(const unsigned char *start, int maxlength, int maxskip);
+	//resolved by parse from the codec name.
+	MatchFunction match_function = &Codec::unknownMatch;
+	SearchFunction search_function = nullptr;
+
+	Match match(const unsigned char *start, int maxlength) { return (this->*match_function)(start, maxlength); }
+	//changes when match could give a different result for the same data.
+	int stamp() const { return tmcd_seen; }
 	Match search(const unsigned char *start, int maxlength, int maxskip);
 
 	//sometimes (maybe) rtp info is present without a track
 static	Match rtpMatch(const unsigned char *start, int maxlength);
+	Match rtpTrackMatch(const unsigned char *start, int maxlength) { return rtpMatch(start, maxlength); }
 
 	Match avc1Match(const unsigned char *start, int maxlength);
 	Match avc1Search(const unsigned char *start, int maxlength, int makskip);
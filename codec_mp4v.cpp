@@ -37,8 +37,9 @@ Match Codec::mp4vMatch(const unsigned char *start, int maxlength) {
 		AvLog useAvLog();
 		av_log_set_level(0);
 
-		static AVPacket* packet = av_packet_alloc();
-		static AVFrame* frame = av_frame_alloc();
+		//one per thread: segments of mdat are matched in parallel.
+		static thread_local AVPacket* packet = av_packet_alloc();
+		static thread_local AVFrame* frame = av_frame_alloc();
 
 		packet->data = const_cast<unsigned char*>(start);
 		packet->size = maxlength;
@@ -46,6 +46,13 @@ void CodecStats::init(Track &track, BufferedAtom *mdat) {
 	std::vector<Track::Chunk> &chunks = track.chunks;
 	if(!chunks.size())
 		return;
+
+	total_size = 0;
+	for(Track::Chunk &chunk: chunks)
+		total_size += chunk.size;
+	size_t npackets = track.default_size ? chunks.size() : track.reference_sizes.size();
+	if(npackets)
+		average_size = total_size / double(npackets);
 	fixed_size = chunks[0].size;
 	//last chunk is skipped as in pcm could be a bit smaller.
 	for(size_t i = 0; i < chunks.size()-1; i++) {
@@ -97,7 +104,7 @@ void CodecStats::init(Track &track, BufferedAtom *mdat) {
 				beginnings32[begin32]+= step;
 			}
 			if(!track.default_size) { //pcm codecs with small samples.
-				offset += track.sample_sizes[current_sample];
+				offset += track.getSize(current_sample);
 				current_sample++;
 			} else if(track.default_size > 80) {
 				offset += track.default_size;
@@ -25,6 +25,8 @@ public:
 	int32_t fixed_begin32 = 0;
 	int32_t largestSample = 0;
 	int32_t smallestSample = (1<<20);
+	int64_t total_size = 0;   //bytes of the track in the working file.
+	double  average_size = 0; //of the packets found in repair: samples, or chunks if samples have a default size.
 
 	std::map<int32_t, float> beginnings32;
 	std::map<int64_t, float> beginnings64;
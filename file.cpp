@@ -25,7 +25,20 @@
 #include <string>
 #include <cstdio>
 #include <cassert>
+#include <cerrno>
 #include <iostream>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+# include <io.h>
+#else
+# include <unistd.h>
+#endif
+#ifdef __linux__
+# include <sys/sendfile.h>
+#endif
 
 using namespace std;
 
@@ -53,14 +66,69 @@ uint64_t swap64(uint64_t ull) {
 
 
 
-// Update file_sz on every write to the file.
-#define FILE_SIZE_UPDATE_ON_WRITE   1
 // Seek from end-of-file when seeking to a negative offset.
 //#define FILE_SEEK_FROM_END          1
 
+// Writes smaller than this are collected and written together.
+static const size_t WriteBufferSize = 1<<20;
+
+// Let the kernel copy between files (copy_file_range needs glibc 2.27).
+#if defined(__linux__) && defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+# define FILE_COPY_RANGE             1
+#endif
+#ifdef __linux__
+# define FILE_SENDFILE               1
+#endif
+
+#ifndef O_BINARY
+# define O_BINARY 0
+#endif
+
+#ifdef _WIN32
+// No positional I/O in the C runtime: emulate it.
+static ssize_t pread(int fd, void *dest, size_t n, off_t offset) {
+	if(_lseeki64(fd, offset, SEEK_SET) < 0)
+		return -1;
+	return _read(fd, dest, static_cast<unsigned int>(n));
+}
+
+static ssize_t pwrite(int fd, const void *source, size_t n, off_t offset) {
+	if(_lseeki64(fd, offset, SEEK_SET) < 0)
+		return -1;
+	return _write(fd, source, static_cast<unsigned int>(n));
+}
+#endif
+
+// Read n bytes at offset, retrying on short reads; returns the bytes read.
+static size_t readAll(int fd, char *dest, size_t n, off_t offset) {
+	size_t done = 0;
+	while(done < n) {
+		ssize_t len = pread(fd, dest + done, n - done, offset + done);
+		if(len < 0 && errno == EINTR)
+			continue;
+		if(len <= 0)
+			break;
+		done += len;
+	}
+	return done;
+}
+
+static bool writeAll(int fd, const char *source, size_t n, off_t offset) {
+	size_t done = 0;
+	while(done < n) {
+		ssize_t len = pwrite(fd, source + done, n - done, offset + done);
+		if(len < 0 && errno == EINTR)
+			continue;
+		if(len <= 0)
+			return false;
+		done += len;
+	}
+	return true;
+}
 
-// Encapsulate FILE (RAII).
-File::File() : file(NULL), file_sz(-1) { }
+
+// Encapsulate a file descriptor (RAII).
+File::File() : fd(-1), offset(0), file_sz(-1), failed(false), pending_pos(0) { }
 
 File::~File() {
 	close();
@@ -72,16 +140,16 @@ bool File::open(string filename) {
 
 	if(filename.empty())
 		return false;
-	file = fopen(filename.c_str(), "rb");
-	if(!file)
+	fd = ::open(filename.c_str(), O_RDONLY | O_BINARY);
+	if(fd < 0)
 		return false;
 
-	fseeko(file, 0L, SEEK_END);
-	off_t sz = ftello(file);
-	fseeko(file, 0L, SEEK_SET);
-	if(sz < 0)
+	struct stat st;
+	if(fstat(fd, &st) != 0 || st.st_size < 0) {
+		close();
 		return false;
-	file_sz = sz;
+	}
+	file_sz = st.st_size;
 	return true;
 }
 
@@ -90,95 +158,101 @@ bool File::create(string filename) {
 
 	if(filename.empty())
 		return false;
-	file = fopen(filename.c_str(), "wb");
-	if(!file)
+	fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
+	if(fd < 0)
 		return false;
 
-#ifdef FILE_SIZE_UPDATE_ON_WRITE
 	file_sz = 0;
-#endif
 	return true;
 }
 
-void File::close() {
-	if(file) {
-		FILE *rm_file = file;
-		file = NULL;
-		fclose(rm_file);
+bool File::edit(string filename) {
+	close();
+
+	if(filename.empty())
+		return false;
+	fd = ::open(filename.c_str(), O_RDWR | O_BINARY);
+	if(fd < 0)
+		return false;
+
+	struct stat st;
+	if(fstat(fd, &st) != 0 || st.st_size < 0) {
+		close();
+		return false;
+	}
+	file_sz = st.st_size;
+	return true;
+}
+
+bool File::close() {
+	bool ok = true;
+	if(fd >= 0) {
+		ok = flush();
+		int rm_fd = fd;
+		fd = -1;
+		if(::close(rm_fd) != 0)
+			ok = false;
 	}
+	pending.clear();
+	offset  = 0;
 	file_sz = -1;
+	failed  = false;
+	return ok;
 }
 
 
 off_t File::pos() {
-	return (file) ? ftello(file) : off_t(-1);
+	return (fd >= 0) ? offset : off_t(-1);
 }
 
 void File::seek(off_t offset) {
 #ifdef FILE_SEEK_FROM_END
-	if(file)
-		fseeko(file, offset, (offset >= 0) ? SEEK_SET : SEEK_END);
+	if(fd >= 0)
+		this->offset = (offset >= 0) ? offset : size() + offset;
 #else
 	assert(offset >= 0);
-	if(file && offset >= 0)
-		fseeko(file, offset, SEEK_SET);
+	if(fd >= 0 && offset >= 0)
+		this->offset = offset;
 #endif
 }
 
 void File::rewind() {
-	if(file) {
-		fseeko(file, 0L, SEEK_SET);
-		clearerr(file);
-	}
+	offset = 0;
 }
 
 bool File::atEnd() {
-	if(!file)
+	if(fd < 0)
 		return true;
-	off_t pos = ftello(file);
-	if(pos < 0)
+	off_t sz = size();
+	if(sz < 0)
 		return true;
-	off_t sz  = file_sz;
-#ifndef FILE_SIZE_UPDATE_ON_WRITE
-	if(sz < 0) {
-		fseeko(file, 0L,  SEEK_END);
-		sz = ftello(file);
-		fseeko(file, pos, SEEK_SET);
-	}
-#endif
-	return (pos >= sz);
+	return (offset >= sz);
 }
 
 off_t File::size() {
-#ifdef FILE_SIZE_UPDATE_ON_WRITE
 	return file_sz;
-#else
-	if(file_sz >= 0)
-		return file_sz;
-	if(!file)
-		return -1;
-	off_t pos = ftello(file);
-	if(pos < 0)
-		return -1;
-	fseeko(file, 0L,  SEEK_END);
-	off_t sz  = ftello(file);
-	fseeko(file, pos, SEEK_SET);
-	if(sz < 0)
-		return -1;
-	return sz;
-#endif
 }
 
 
+void File::readAt(char *dest, size_t n, const char *error) {
+	if(n == 0)
+		return;
+	if(fd < 0)
+		throw string(error);
+	if(!pending.empty())
+		flush();
+	size_t len = readAll(fd, dest, n, offset);
+	if(len != n)
+		throw string(error);
+	offset += n;
+}
+
 uint32_t File::readUInt() {
-	uint32_t value = 0;
-	size_t n = (file) ? fread(&value, sizeof(value), 1, file) : 0;
-	if(n != 1)
-		throw string("Could not read atom length");
+	uint8_t p[4];
+	readAt(reinterpret_cast<char *>(p), sizeof(p), "Could not read atom length");
 
 	// Read a 32-bit big-endian value.
 	// A compiler will optimize this to a single instruction if possible.
-	const uint8_t *p = reinterpret_cast<const uint8_t*>(&value);
 	return ((uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | uint32_t(p[3]));
 }
 
@@ -189,124 +263,170 @@ int32_t File::readInt() {
 }
 
 int64_t File::readInt64() {
-	uint64_t value = 0;
-	size_t n = (file) ? fread(&value, sizeof(value), 1, file) : 0;
-	if(n != 1)
-		throw string("Could not read atom length");
+	uint8_t p[8];
+	readAt(reinterpret_cast<char *>(p), sizeof(p), "Could not read atom length");
 
 	// Read a 64-bit big-endian value.
 	// A compiler will optimize this to a single instruction if possible.
-	const uint8_t *p = reinterpret_cast<const uint8_t*>(&value);
 	return ( (uint64_t(p[0]) << 56) | (uint64_t(p[1]) << 48) | (uint64_t(p[2]) << 40) | (uint64_t(p[3]) << 32)
 	       | (uint64_t(p[4]) << 24) | (uint64_t(p[5]) << 16) | (uint64_t(p[6]) <<  8) |  uint64_t(p[7]) );
 }
 
 void File::readChar(char *dest, size_t n) {
 	assert(dest != NULL || n == 0);
-	if(n > 0) {
-		size_t len = fread(dest, sizeof(char), n, file);
-		if(len != n)
-			throw string("Could not read chars");
-	}
+	readAt(dest, n, "Could not read chars");
 }
 
 vector<unsigned char> File::read(size_t n) {
 	vector<unsigned char> dest(n);
-	if(n > 0) {
-		size_t len = fread(&dest[0], sizeof(unsigned char), n, file);
-		if(len != n)
-			throw string("Could not read at position");
-	}
+	if(n > 0)
+		readAt(reinterpret_cast<char *>(&dest[0]), n, "Could not read at position");
 	return dest;
 }
 
 
-ssize_t File::writeInt(int32_t value) {
-	if(!file)
+// Append to the pending writes, or write directly if large.
+ssize_t File::writeAt(const char *source, size_t n) {
+	if(fd < 0)
 		return -1;
+	if(!pending.empty() && pending_pos + off_t(pending.size()) != offset) {
+		if(!flush())
+			return -1;
+	}
 
+	if(n >= WriteBufferSize) {
+		if(!flush())
+			return -1;
+		if(!writeAll(fd, source, n, offset)) {
+			failed = true;
+			return -1;
+		}
+	} else {
+		if(pending.empty())
+			pending_pos = offset;
+		pending.insert(pending.end(), source, source + n);
+		if(pending.size() >= WriteBufferSize && !flush())
+			return -1;
+	}
+	offset += n;
+	if(file_sz < offset)
+		file_sz = offset;
+	return n;
+}
+
+bool File::flush() {
+	if(!pending.empty()) {
+		if(fd < 0 || !writeAll(fd, &pending[0], pending.size(), pending_pos))
+			failed = true;
+		pending.clear();
+	}
+	return !failed;
+}
+
+
+ssize_t File::writeInt(int32_t value) {
 	// Write a 32-bit big-endian value.
 	// A compiler can optimize the endian conversion to 1 or 2 instructions if possible.
 	uint32_t val32 = value;
-	uint8_t  data[4] = {
-		static_cast<uint8_t>(val32 >> 24),
-		static_cast<uint8_t>(val32 >> 16),
-		static_cast<uint8_t>(val32 >>  8),
-		static_cast<uint8_t>(val32)
+	char     data[4] = {
+		static_cast<char>(val32 >> 24),
+		static_cast<char>(val32 >> 16),
+		static_cast<char>(val32 >>  8),
+		static_cast<char>(val32)
 	};
 
-	size_t len = fwrite(&data, sizeof(data), 1, file);
-	if(len == 0)
-		return (ferror(file)) ? -1 : 0;
-#ifdef FILE_SIZE_UPDATE_ON_WRITE
-	off_t  pos = ftello(file);
-	if(file_sz < pos)
-		file_sz = pos;
-#endif
-	return len;
+	ssize_t len = writeAt(data, sizeof(data));
+	return (len < 0) ? -1 : 1;
 }
 
 ssize_t File::writeInt64(int64_t value) {
-	if(!file)
-		return -1;
-
 	// Write a 64-bit big-endian value.
 	// A compiler can optimize the endian conversion to 1 or 2 instructions if possible.
 	uint64_t val64 = value;
-	uint8_t  data[8] = {
-		static_cast<uint8_t>(val64 >> 56),
-		static_cast<uint8_t>(val64 >> 48),
-		static_cast<uint8_t>(val64 >> 40),
-		static_cast<uint8_t>(val64 >> 32),
-		static_cast<uint8_t>(val64 >> 24),
-		static_cast<uint8_t>(val64 >> 16),
-		static_cast<uint8_t>(val64 >>  8),
-		static_cast<uint8_t>(val64)
+	char     data[8] = {
+		static_cast<char>(val64 >> 56),
+		static_cast<char>(val64 >> 48),
+		static_cast<char>(val64 >> 40),
+		static_cast<char>(val64 >> 32),
+		static_cast<char>(val64 >> 24),
+		static_cast<char>(val64 >> 16),
+		static_cast<char>(val64 >>  8),
+		static_cast<char>(val64)
 	};
 
-	size_t len = fwrite(&data, sizeof(data), 1, file);
-	if(len == 0)
-		return (ferror(file)) ? -1 : 0;
-#ifdef FILE_SIZE_UPDATE_ON_WRITE
-	off_t  pos = ftello(file);
-	if(file_sz < pos)
-		file_sz = pos;
-#endif
-	return len;
+	ssize_t len = writeAt(data, sizeof(data));
+	return (len < 0) ? -1 : 1;
 }
 
 ssize_t File::writeChar(const char *source, size_t n) {
 	assert(source != NULL || n == 0);
 	if(n == 0)
 		return  0;
-	if(!file)
-		return -1;
-
-	size_t len = fwrite(source, sizeof(char), n, file);
-	if(len == 0)
-		return (ferror(file)) ? -1 : 0;
-#ifdef FILE_SIZE_UPDATE_ON_WRITE
-	off_t  pos = ftello(file);
-	if(file_sz < pos)
-		file_sz = pos;
-#endif
-	return len;
+	return writeAt(source, n);
 }
 
 ssize_t File::write(vector<unsigned char> &v) {
 	if(v.empty())
 		return  0;
-	if(!file)
+	return writeAt(reinterpret_cast<const char *>(&v[0]), v.size());
+}
+
+
+// Copy without going through userspace when possible: copy_file_range (which
+//  can reflink on XFS/btrfs), then sendfile, then a plain read/write loop.
+ssize_t File::copy(File &source, off_t from, off_t n) {
+	if(fd < 0 || source.fd < 0 || !flush() || !source.flush())
 		return -1;
 
-	size_t len = fwrite(&v[0], sizeof(unsigned char), v.size(), file);
-	if(len == 0)
-		return (ferror(file)) ? -1 : 0;
-#ifdef FILE_SIZE_UPDATE_ON_WRITE
-	off_t  pos = ftello(file);
-	if(file_sz < pos)
-		file_sz = pos;
+	off_t in  = from;
+	off_t out = offset;
+	off_t end = from + n;
+
+#ifdef FILE_COPY_RANGE
+	while(in < end) {
+		loff_t in_off = in, out_off = out;
+		ssize_t len = copy_file_range(source.fd, &in_off, fd, &out_off, size_t(end - in), 0);
+		if(len < 0 && errno == EINTR)
+			continue;
+		if(len <= 0)
+			break; //EXDEV, ENOSYS, EINVAL...: try the next method.
+		in  += len;
+		out += len;
+	}
 #endif
-	return len;
-}
+#ifdef FILE_SENDFILE
+	//sendfile writes at the current descriptor position.
+	if(in < end && lseek(fd, out, SEEK_SET) == out) {
+		while(in < end) {
+			off_t in_off = in;
+			ssize_t len = sendfile(fd, source.fd, &in_off, size_t(std::min<off_t>(end - in, 1<<30)));
+			if(len < 0 && errno == EINTR)
+				continue;
+			if(len <= 0)
+				break;
+			in  += len;
+			out += len;
+		}
+	}
+#endif
+	if(in < end) {
+		vector<char> buff(size_t(std::min<off_t>(end - in, 1<<20)));
+		while(in < end) {
+			size_t toread = size_t(std::min<off_t>(end - in, off_t(buff.size())));
+			if(readAll(source.fd, &buff[0], toread, in) != toread)
+				break;
+			if(!writeAll(fd, &buff[0], toread, out))
+				break;
+			in  += toread;
+			out += toread;
+		}
+	}
 
+	ssize_t done = ssize_t(in - from);
+	offset = out;
+	if(file_sz < offset)
+		file_sz = offset;
+	if(in != end)
+		failed = true;
+	return (in == end) ? done : -1;
+}
@@ -28,6 +28,7 @@ extern "C" {
 #include <stdint.h>
 }
 #include <cstdio>
+#include <sys/types.h>
 
 
 // Swap the 8-bit bytes into their reverse order.
@@ -36,7 +37,9 @@ uint32_t swap32(uint32_t ui);
 uint64_t swap64(uint64_t ull);
 
 
-// Encapsulate FILE (RAII).
+// Encapsulate a file descriptor (RAII).
+// Reads and writes are positional (pread/pwrite): seeking is free and reads
+//  land directly in the caller buffer. Small writes are collected in a buffer.
 class File {
 public:
 	File();
@@ -44,8 +47,10 @@ public:
 
 	bool open  (std::string filename);
 	bool create(std::string filename);
+	bool edit  (std::string filename); //read and write an existing file.
 
-	operator bool() { return static_cast<bool>(file); }
+	operator bool() { return fd >= 0; }
+	int descriptor() { return fd; } //underlying OS file descriptor, -1 if not open.
 
 	off_t pos();
 	void  seek(off_t offset);
@@ -65,12 +70,21 @@ public:
 	ssize_t writeInt64(int64_t value);
 	ssize_t writeChar (const char *source, size_t n);
 	ssize_t write(std::vector<unsigned char> &v);
+	ssize_t copy(File &source, off_t from, off_t n); //copy n bytes of source at from to the current position.
+	bool    flush(); //write out buffered data, false if any write since opening failed.
+	bool    close(); //flush and close, false if a write or closing failed.
 
 protected:
-	std::FILE *file;
+	int   fd;
+	off_t offset;  //current position.
 	off_t file_sz;
+	bool  failed;  //a write failed, reported by flush.
 
-	void close();
+	std::vector<char> pending;     //buffered writes, starting at pending_pos.
+	off_t             pending_pos;
+
+	void    readAt(char *dest, size_t n, const char *error);
+	ssize_t writeAt(const char *source, size_t n);
 
 private:
 	// Disable copying.
@@ -25,6 +25,10 @@
 #include <cstdlib>
 #include <iostream>
 #include <string>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <memory>
 using namespace std;
 
 void usage() {
@@ -42,7 +46,12 @@ void usage() {
 		 << "	-q: silent\n"
 		 << "	-e: error\n"
 		 << "	-v; verbose\n"
-		 << "	-w: debug info\n\n";
+		 << "	-w: debug info\n"
+		 << "	--readahead <MB>: background read-ahead of the corrupt file (0 disables)\n"
+		 << "	--threads <n>: scan the corrupt file in n segments in parallel (default 1, 0 one per core)\n"
+		 << "	--certainty <chances>: skip the other tracks when a match is this sure (default 1048576, 0 matches all)\n"
+		 << "	--race: try all the strategies to locate mdat at the same time, keep the best\n"
+		 << "	--in-place: append the rebuilt moov to the corrupt file instead of writing a copy\n\n";
 }
 
 void searchFile(std::string ok, std::vector<uint8_t> search) {
@@ -92,6 +101,82 @@ std::vector<uint8_t> hexToStr(const char *str) {
 	return s;
 }
 
+//repair with each strategy at the same time, every racer has its own copy of the working file.
+//A racer that walks up to the end of the file, or matches SurePackets in a row, stops the others;
+//otherwise the one recovering more bytes wins.
+int raceRepair(vector<Mp4 *> &racers, const vector<Mp4::MdatStrategy> &strategies, string corrupt,
+			   int64_t mdat_begin, bool skip_zeros, bool drifting) {
+	const int64_t SurePackets = 2000;
+	size_t n = racers.size();
+	unique_ptr<std::atomic<bool>[]> stop(new std::atomic<bool>[n]);
+	std::atomic<size_t> running(n);
+	vector<char> success(n, 0);
+	auto run = [&](size_t i) {
+		try {
+			//drifting only for the first, as when trying them one after the other.
+			success[i] = racers[i]->repair(corrupt, strategies[i], mdat_begin, skip_zeros, i == 0 && drifting);
+		} catch(string e) {
+			Log::error << e << endl;
+		} catch(const char *e) {
+			Log::error << e << endl;
+		}
+	};
+	auto stopOthers = [&](size_t i) {
+		for(size_t k = 0; k < n; k++)
+			if(k != i)
+				stop[k] = true;
+	};
+
+	vector<std::thread> threads;
+	for(size_t i = 0; i < n; i++) {
+		stop[i] = false;
+		racers[i]->cancel = &stop[i];
+		threads.emplace_back([&, i]() {
+			run(i);
+			if(success[i] && racers[i]->reached_end)
+				stopOthers(i);
+			running--;
+		});
+	}
+	//the first racer sure enough of its walk stops the others and goes on alone.
+	int leader = -1;
+	while(running > 0) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		for(size_t i = 0; i < n && leader < 0; i++) {
+			if(!stop[i] && racers[i]->sure_packets >= SurePackets) {
+				Log::info << "Strategy " << strategies[i] << " matched " << SurePackets << " packets in a row, stopping the others\n";
+				leader = i;
+				stopOthers(i);
+			}
+		}
+	}
+	for(std::thread &thread: threads)
+		thread.join();
+
+	int best = -1;
+	for(size_t i = 0; i < n; i++) {
+		racers[i]->cancel = NULL;
+		if(!success[i])
+			continue;
+		if(best < 0 ||
+		   racers[i]->reached_end > racers[best]->reached_end ||
+		   (racers[i]->reached_end == racers[best]->reached_end && racers[i]->recovered > racers[best]->recovered))
+			best = i;
+	}
+	//the leader failed after all, walk the others to the end.
+	for(size_t i = 0; best < 0 && leader >= 0 && i < n; i++) {
+		if(int(i) == leader)
+			continue;
+		Log::info << "Retrying strategy " << strategies[i] << "\n";
+		run(i);
+		if(success[i])
+			best = i;
+	}
+	if(best >= 0)
+		Log::info << "Best result with strategy " << strategies[best] << ": " << racers[best]->recovered << " bytes\n";
+	return best;
+}
+
 int main(int argc, char *argv[]) {
 
 	std::string output_filename;
@@ -104,6 +189,8 @@ int main(int argc, char *argv[]) {
 	//bool same_mdat_start = false; //if mdat can be found or starting of packets try using the same absolute offset.
 	//bool ignore_mdat_start = false; //ignore mdat string and look for first recognizable packet.
 	bool skip_zeros = true;
+	bool in_place = false;
+	bool race = false;
 	int64_t mdat_begin = -1; //start of packets if specified.
 	int i = 1;
 	std::vector<uint8_t> search;
@@ -126,6 +213,30 @@ int main(int argc, char *argv[]) {
 			case 'b': mdat_strategy = Mp4::SPECIFIED; mdat_begin = atoi(argv[i+1]); i++; break;
 			case 'B': skip_zeros = false; break;
 			case 'S': search = hexToStr(argv[i+1]); i++; break;
+			case '-':
+				//options taking a value.
+				if((arg == "--readahead" || arg == "--threads" || arg == "--certainty") && i + 1 >= argc) {
+					usage();
+					return -1;
+				}
+				if(arg == "--readahead") {
+					BufferedAtom::default_readahead = int64_t(atoi(argv[i+1])) << 20;
+					i++;
+				} else if(arg == "--threads") {
+					Mp4::threads = atoi(argv[i+1]);
+					i++;
+				} else if(arg == "--certainty") {
+					Mp4::certainty = atof(argv[i+1]);
+					i++;
+				} else if(arg == "--in-place")
+					in_place = true;
+				else if(arg == "--race")
+					race = true;
+				else {
+					usage();
+					return -1;
+				}
+				break;
 			}
 		} else
 			break;
@@ -164,9 +275,28 @@ int main(int argc, char *argv[]) {
 
 		if(corrupt.size()) {
 
-			bool success = mp4.repair(corrupt, mdat_strategy, mdat_begin, skip_zeros, drifting);
+			Mp4 *repaired = &mp4;
+			vector<unique_ptr<Mp4>> racers;
+			bool success = false;
+			if(race && mdat_strategy == Mp4::FIRST) {
+				vector<Mp4::MdatStrategy> strategies = { Mp4::FIRST, Mp4::SAME, Mp4::SEARCH, Mp4::LAST };
+				vector<Mp4 *> contenders = { &mp4 };
+				for(size_t k = 1; k < strategies.size(); k++) {
+					racers.emplace_back(new Mp4);
+					racers.back()->open(ok);
+					contenders.push_back(racers.back().get());
+				}
+				//share the cores among the racers.
+				if(Mp4::threads == 0)
+					Mp4::threads = std::max(1, int(std::thread::hardware_concurrency()/strategies.size()));
+				int best = raceRepair(contenders, strategies, corrupt, mdat_begin, skip_zeros, drifting);
+				success = best >= 0;
+				if(success)
+					repaired = contenders[best];
+			} else
+				success = mp4.repair(corrupt, mdat_strategy, mdat_begin, skip_zeros, drifting);
 			//if the user didn't specify the strategy, try them all.
-			if(!success  && mdat_strategy == Mp4::FIRST) {
+			if(!success && !race && mdat_strategy == Mp4::FIRST) {
 				vector<Mp4::MdatStrategy> strategies = { Mp4::SAME, Mp4::SEARCH, Mp4::LAST };
 				for(Mp4::MdatStrategy strategy: strategies) {
 					Log::info << "\n\nTrying a different approach to locate mdat start" << endl;
@@ -178,10 +308,20 @@ int main(int argc, char *argv[]) {
 				Log::error << "Failed recovering the file\n";
 			}
 
+			if(in_place) {
+				//never touch the corrupt file unless we got something.
+				if(success)
+					success = repaired->save(corrupt, true);
+				return success ? 0 : -1;
+			}
+
 			size_t lastindex = corrupt.find_last_of(".");
 			if(output_filename.size() == 0)
 				output_filename = corrupt.substr(0, lastindex) + "_fixed.mp4";
-			mp4.saveVideo(output_filename);
+			if(!repaired->saveVideo(output_filename)) {
+				Log::error << "Failed saving: " << output_filename << "\n";
+				return -1;
+			}
 		}
 	} catch(string e) {
 		Log::error << e << endl;
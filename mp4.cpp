@@ -29,6 +29,11 @@
 #include <ios>          // Pre-C++11: may not be included by <iostream>.
 #include <iomanip>
 #include <limits>
+#include <cmath>
+#include <unordered_map>
+#include <unordered_set>
+#include <thread>
+#include <mutex>
 
 #ifndef  __STDC_LIMIT_MACROS
 # define __STDC_LIMIT_MACROS    1
@@ -67,6 +72,13 @@ using namespace std;
 
 namespace {
 const int MaxFrameLength = 20000000;
+const int64_t MinSegmentSize = 64<<20; //smaller mdat segments are not worth a thread.
+//a predicted track this likely, matching this well, is taken without trying the others.
+const float LikelyTrack = 0.9f;
+const float ConfidentChances = 1000.0f;
+//libav setup (avformat_open_input, avcodec_open2...) is not thread safe, and with --race
+//several repairs set up their segment workers at the same time.
+std::mutex libav_setup;
 
 
 // Store start-up addresses of C++ stdio stream buffers as identifiers.
@@ -170,7 +182,11 @@ public:
 
 
 // Mp4
-Mp4::Mp4() : timescale(0), duration(0), root(NULL), context(NULL) { }
+int Mp4::threads = 1;
+float Mp4::certainty = 1<<20;
+
+Mp4::Mp4() : timescale(0), duration(0), cancel(NULL), sure_packets(0), recovered(0), reached_end(false),
+	source(NULL), root(NULL), context(NULL) { }
 
 Mp4::~Mp4() {
 	close();
@@ -181,17 +197,18 @@ void Mp4::open(string filename) {
 	close();
 
 	try {  // Parse ok file.
-		File file;
+		source = new File;
+		File &file = *source;
 		if(!file.open(filename))
 			throw "Could not open file: " + filename;
 
-		root = new Atom;
+		root = Atom::newTree();
 		do {
-			Atom *atom = new Atom;
-			atom->parse(file);
+			Atom *atom = Atom::create(root->arena);
+			atom->parse(file, true);
 			Log::debug << "Found atom: " << atom->name << '\n';
 
-			root->children.push_back(atom);
+			root->addChild(atom);
 		} while(!file.atEnd());
 
 	} catch(const string &error) {
@@ -249,6 +266,9 @@ void Mp4::close() {
 	timescale = 0;
 	duration  = 0;
 	tracks.clear();     // Must clear tracks before closing context.
+	for(AVCodecContext *codec_context: codec_contexts)
+		avcodec_free_context(&codec_context);
+	codec_contexts.clear();
 	if(context) {
 		AvLog useAvLog(AV_LOG_ERROR);
 #ifdef OLD_AVFORMAT_API
@@ -259,7 +279,40 @@ void Mp4::close() {
 		context = NULL;
 	}
 	file_name.clear();
-	delete rm_root;
+	Atom::destroy(rm_root);
+	delete source;      // After the atoms, they might still read from it.
+	source = NULL;
+}
+
+//set up as a segment worker of parent: same tracks and interleave model without parsing
+//the reference again, but decoders of its own (they keep state between packets).
+void Mp4::share(const Mp4 &parent) {
+	close();
+	file_name   = parent.file_name;
+	timescale   = parent.timescale;
+	duration    = parent.duration;
+	tracks      = parent.tracks;
+	interleave  = parent.interleave;
+	match_order = parent.match_order;
+
+	for(Track &track: tracks) {
+		AVCodecContext *shared = track.codec.context;
+		if(!shared)
+			continue;
+		AVCodecContext *own = avcodec_alloc_context3(NULL);
+		if(!own)
+			throw string("Could not allocate codec context");
+		codec_contexts.push_back(own);
+		AVCodecParameters *parameters = avcodec_parameters_alloc();
+		bool copied = parameters && avcodec_parameters_from_context(parameters, shared) >= 0 &&
+			avcodec_parameters_to_context(own, parameters) >= 0;
+		avcodec_parameters_free(&parameters);
+		if(!copied)
+			throw string("Could not copy codec context");
+		if(track.codec.codec && avcodec_open2(own, track.codec.codec, NULL) < 0)
+			throw string("Could not open codec: ") + track.codec.name;
+		track.codec.context = own;
+	}
 }
 
 void Mp4::printMediaInfo() {
@@ -293,7 +346,7 @@ bool Mp4::makeStreamable(string filename, string output_filename) {
 			Atom *atom = new Atom;
 			atom->parse(file);
 			Log::debug << "Found atom: " << atom->name << '\n';
-			atom_root.children.push_back(atom);
+			atom_root.addChild(atom);
 		}
 	}  // {
 
@@ -329,7 +382,7 @@ bool Mp4::makeStreamable(string filename, string output_filename) {
 		if(stbl) {
 			Atom *new_stco = new Atom;
 			memcpy(new_stco->name, "stco", min(sizeof("stco"), sizeof(new_stco->name)-1));
-			stbl->children.push_back(new_stco);
+			stbl->addChild(new_stco);
 		}
 	}
 #endif
@@ -355,12 +408,96 @@ bool Mp4::makeStreamable(string filename, string output_filename) {
 			ftyp->write(file);
 		moov->write(file);
 		mdat->write(file);
+		if(!file.close())
+			throw "Could not write: " + output_filename;
 	}  // {
 	Log::debug << endl;
 	return true;
 }
 
-bool Mp4::save(string output_filename) {
+// Turn the bytes in front of the first packet into a valid mdat header
+// reaching the end of the file, where moov gets appended.
+// Patch the existing header if there is one, otherwise write ftyp, free and mdat
+// over the unused bytes in front.
+static bool writeMdatHeaderInPlace(File &file, int64_t content_begin, Atom *ftyp) {
+	int64_t end = file.size();
+	uint8_t head[16];
+
+	if(content_begin >= 16) {
+		file.seek(content_begin - 16);
+		file.readChar(reinterpret_cast<char *>(head), 16);
+		if(readBE<uint32_t>(head) == 1 && !memcmp(head + 4, "mdat", 4)) {
+			Log::debug << "Patching 64 bit mdat header.\n";
+			file.seek(content_begin - 8);
+			return file.writeInt64(end - content_begin + 16) > 0;
+		}
+	}
+	bool fits32 = end - content_begin + 8 < (int64_t(1)<<32);
+	if(content_begin >= 8 && fits32) {
+		file.seek(content_begin - 8);
+		file.readChar(reinterpret_cast<char *>(head), 8);
+		if(!memcmp(head + 4, "mdat", 4)) {
+			Log::debug << "Patching mdat header.\n";
+			file.seek(content_begin - 8);
+			return file.writeInt(end - content_begin + 8) > 0;
+		}
+	}
+
+	int64_t header = fits32 ? 8 : 16;
+	int64_t gap = content_begin - header;
+	if(gap < 0 || (gap > 0 && gap < 8))
+		throw string("No room for the mdat header in front of the first packet");
+
+	//keep the ftyp of the file if it's still in front of the header, or write the one of the working file.
+	auto fits = [gap](int64_t length) { return gap == length || gap >= length + 8; };
+	vector<unsigned char> out;
+	int64_t out_begin = 0;
+	if(content_begin >= 8) {
+		file.seek(0);
+		file.readChar(reinterpret_cast<char *>(head), 8);
+		int64_t length = readBE<uint32_t>(head);
+		if(!memcmp(head + 4, "ftyp", 4) && length >= 8 && fits(length))
+			out_begin = length;
+	}
+	if(!out_begin && ftyp) {
+		if(!fits(ftyp->length))
+			throw string("No room for ftyp in front of the mdat header, can't repair in place");
+		ftyp->serialize(file, out);
+	}
+	gap -= out_begin + int64_t(out.size());
+
+	Log::debug << "Writing a new mdat header at: " << content_begin - header << "\n";
+	size_t pos = out.size();
+	if(gap >= (int64_t(1)<<32)) {
+		out.resize(pos + 16);
+		writeBE<int32_t>(&out[pos], 1);
+		memcpy(&out[pos + 4], "free", 4);
+		writeBE<int64_t>(&out[pos + 8], gap);
+	} else if(gap > 0) {
+		out.resize(pos + 8);
+		writeBE<int32_t>(&out[pos], gap);
+		memcpy(&out[pos + 4], "free", 4);
+	}
+	file.seek(out_begin);
+	if(file.write(out) != ssize_t(out.size()))
+		return false;
+
+	out.clear();
+	if(header == 16) {
+		out.resize(16);
+		writeBE<int32_t>(&out[0], 1);
+		memcpy(&out[4], "mdat", 4);
+		writeBE<int64_t>(&out[8], end - content_begin + 16);
+	} else {
+		out.resize(8);
+		writeBE<int32_t>(&out[0], end - content_begin + 8);
+		memcpy(&out[4], "mdat", 4);
+	}
+	file.seek(content_begin - header);
+	return file.write(out) == ssize_t(out.size());
+}
+
+bool Mp4::save(string output_filename, bool in_place) {
 	// We save all atoms except:
 	//  ctts: composition offset (we use sample to time).
 	//  cslg: because it is used only when ctts is present.
@@ -387,6 +524,7 @@ bool Mp4::save(string output_filename) {
 		if(track.timescale == 0 && track.duration != 0)
 			Log::info << "Track " << i << " (" << track.codec.name << ") has no time scale.\n";
 
+		track.chunk_offsets64 = false; //switched to co64 below if the offsets don't fit.
 		track.writeToAtoms();
 
 		// Convert duration to movie timescale.
@@ -435,24 +573,60 @@ bool Mp4::save(string output_filename) {
 
 	root->updateLength();
 
+	BufferedAtom *repaired = dynamic_cast<BufferedAtom *>(mdat);
+	if(in_place && !repaired) {
+		Log::error << "Nothing repaired to save in place.\n";
+		return false;
+	}
 
+	int64_t max_offset = 0;
+	for(Track &track: tracks)
+		max_offset = std::max(max_offset, track.offsets.max());
 
+	//stco if the final offsets fit in 32 bits, co64 otherwise:
+	// co64 takes 4 more bytes per chunk, which moves the packets after moov.
+	int64_t offset = 0;
+	if(in_place) {
+		//packets stay where they are in the repaired file.
+		offset = repaired->file_begin;
+	} else {
+		//we need to add mdat header bytes
+		offset = moov->length + 8;
+		if(mdat->length64)
+			offset += 8;
 
+		if(ftyp)
+			offset += ftyp->length; // Not all .mov have an ftyp.
+	}
+	bool co64 = max_offset + offset >= (int64_t(1)<<32);
+	for(Track &track: tracks) {
+		if(co64 && !in_place && track.trak)
+			offset += 4*int64_t(track.offsets.size());
+	}
 
-	//we need to add mdat header bytes
-	int64_t offset = moov->length + 8;
-	if(mdat->length64)
-		offset += 8;
-
-	if(ftyp)
-		offset += ftyp->length; // Not all .mov have an ftyp.
+	for(Track &track: tracks) {
+		track.offsets.shift(offset);
+		track.chunk_offsets64 = co64;
+		track.saveChunkOffsets();  // Need to save the offsets back to the atoms.
+	}
+	root->updateLength();
 
-	for(unsigned int t = 0; t < tracks.size(); ++t) {
-		Track &track = tracks[t];
-		for(unsigned int i = 0; i < track.offsets.size(); ++i)
-			track.offsets[i] += offset;
+	if(in_place) {
+		File file;
+		if(!file.edit(output_filename))
+			throw "Could not open file for writing: " + output_filename;
 
-		track.writeToAtoms();  // Need to save the offsets back to the atoms.
+		if(!writeMdatHeaderInPlace(file, repaired->file_begin, ftyp)) {
+			Log::error << "Could not write the mdat header in: " << output_filename << "\n";
+			return false;
+		}
+		file.seek(file.size());
+		moov->write(file);
+		if(!file.close()) {
+			Log::error << "Could not write moov in: " << output_filename << "\n";
+			return false;
+		}
+		return true;
 	}
 
 	{  // Save to output file.
@@ -464,6 +638,10 @@ bool Mp4::save(string output_filename) {
 			ftyp->write(file);
 		moov->write(file);
 		mdat->write(file);
+		if(!file.close()) {
+			Log::error << "Could not write: " << output_filename << "\n";
+			return false;
+		}
 	}  // {
 	return true;
 }
@@ -548,8 +726,8 @@ void Mp4::analyze(int analyze_track, bool interactive) {
 			Log::info << "Constant size for samples: " << track.default_size << "\n";
 		} else {
 			Log::info << "Sizes for samples: " << "\n";
-			for(int i = 0; i < 10 && i < track.sample_sizes.size(); i++) {
-				Log::info << track.sample_sizes[i] << " ";
+			for(int i = 0; i < 10 && i < track.reference_sizes.size(); i++) {
+				Log::info << track.reference_sizes[i] << " ";
 			}
 			Log::info << "\n";
 		}
@@ -798,7 +976,7 @@ void Mp4::simulate(Mp4::MdatStrategy strategy, int64_t begin) {
 	}
 }
 
-MatchGroup Mp4::match(int64_t offset, BufferedAtom *mdat) {
+MatchGroup Mp4::match(int64_t offset, BufferedAtom *mdat, int previous, int run) {
 	MatchGroup group;
 	group.offset = offset;
 
@@ -808,19 +986,139 @@ MatchGroup Mp4::match(int64_t offset, BufferedAtom *mdat) {
 	unsigned char *start = mdat->getFragment(offset, maxlength64);
 	int maxlength = static_cast<int>(maxlength64);
 
+	int likely = -1;
+	if(previous >= 0) {
+		float probability = 0.0f;
+		likely = interleave.predict(previous, run, probability);
+		if(probability < LikelyTrack)
+			likely = -1;
+	}
 
-	for(unsigned int i = 0; i < tracks.size(); ++i) {
-		Track &track = tracks[i];
-		Match m = track.codec.match(start, maxlength);
+	//the predicted track first, then the cheapest matchers.
+	for(int k = -1; k < int(match_order.size()); k++) {
+		int i = k < 0 ? likely : match_order[k];
+		if(i < 0 || (k >= 0 && i == likely))
+			continue;
+		Match m;
+		Codec &codec = tracks[i].codec;
+		if(!match_cache.get(mdat, offset, i, codec.stamp(), m)) {
+			m = codec.match(start, maxlength);
+			match_cache.put(mdat, offset, i, codec.stamp(), m);
+		}
 		m.id = i;
 		m.offset = group.offset;
 		group.push_back(m);
+
+		if(m.length == 0 || group.size() == tracks.size())
+			continue;
+		if(((i == likely && m.chances >= ConfidentChances) || (certainty > 0 && m.chances >= certainty))
+				&& !beatable(m.chances, k, likely))
+			break;
 	}
 
 	sort(group.begin(), group.end());//, [](const Match &m1, const Match &m2) { return m1.chances > m2.chances; });
 	return group;
 }
 
+//a track not matched yet (after position k in match_order) could return more chances.
+bool Mp4::beatable(float chances, int k, int likely) {
+	for(size_t j = k + 1; j < match_order.size(); j++) {
+		int i = match_order[j];
+		if(i != likely && tracks[i].codec.max_chances > chances)
+			return true;
+	}
+	return false;
+}
+
+bool MatchCache::get(const BufferedAtom *mdat, int64_t offset, int track, int stamp, Match &match) {
+	if(mdat != source)
+		return false;
+	uint64_t key = (uint64_t(mdat->file_begin + offset) << 8) | track;
+	auto found = index.find(key);
+	if(found == index.end() || found->second->stamp != stamp)
+		return false;
+	entries.splice(entries.begin(), entries, found->second);
+	match = found->second->match;
+	return true;
+}
+
+void MatchCache::put(const BufferedAtom *mdat, int64_t offset, int track, int stamp, const Match &match) {
+	if(mdat != source) {
+		clear();
+		source = mdat;
+	}
+	uint64_t key = (uint64_t(mdat->file_begin + offset) << 8) | track;
+	auto found = index.find(key);
+	if(found != index.end()) {
+		entries.splice(entries.begin(), entries, found->second);
+		found->second->stamp = stamp;
+		found->second->match = match;
+		return;
+	}
+	if(entries.size() >= Capacity) {
+		index.erase(entries.back().key);
+		entries.pop_back();
+	}
+	entries.push_front({ key, stamp, match });
+	index[key] = entries.begin();
+}
+
+void MatchCache::clear() {
+	source = nullptr;
+	entries.clear();
+	index.clear();
+}
+
+const int InterleaveModel::MaxRun;
+
+void InterleaveModel::learn(vector<Track> &tracks) {
+	ntracks = tracks.size();
+	counts.assign(ntracks*(MaxRun + 1)*ntracks, 0);
+	totals.assign(ntracks*(MaxRun + 1), 0);
+
+	//repair finds a packet per sample, or per chunk for tracks with a default sample size.
+	struct Run {
+		int64_t offset;
+		int track;
+		int npackets;
+		bool operator<(const Run &r) const { return offset < r.offset; }
+	};
+	vector<Run> runs;
+	for(int t = 0; t < ntracks; t++)
+		for(Track::Chunk &chunk: tracks[t].chunks)
+			runs.push_back({ int64_t(chunk.offset), t, tracks[t].default_size ? 1 : chunk.nsamples });
+	sort(runs.begin(), runs.end());
+
+	int previous = -1;
+	int run = 0;
+	for(Run &r: runs) {
+		for(int k = 0; k < r.npackets; k++) {
+			if(previous >= 0) {
+				int state = previous*(MaxRun + 1) + std::min(run, MaxRun);
+				counts[state*ntracks + r.track]++;
+				totals[state]++;
+			}
+			run = (r.track == previous) ? run + 1 : 1;
+			previous = r.track;
+		}
+	}
+	if(runs.empty())
+		totals.clear();
+}
+
+int InterleaveModel::predict(int track, int run, float &probability) const {
+	probability = 0.0f;
+	if(empty() || track >= ntracks)
+		return -1;
+	int state = track*(MaxRun + 1) + std::min(run, MaxRun);
+	if(!totals[state])
+		return -1;
+	const uint32_t *next = &counts[state*ntracks];
+	int best = max_element(next, next + ntracks) - next;
+	probability = next[best] / float(totals[state]);
+	return best;
+}
+
 void Mp4::writeTracksToAtoms() {
 	for(unsigned int i = 0; i < tracks.size(); ++i)
 		tracks[i].writeToAtoms();
@@ -845,6 +1143,14 @@ bool Mp4::parseTracks() {
 
 		tracks.push_back(track);
 	}
+	delete mdat;
+	interleave.learn(tracks);
+
+	match_order.clear();
+	for(unsigned int i = 0; i < tracks.size(); ++i)
+		match_order.push_back(i);
+	stable_sort(match_order.begin(), match_order.end(),
+		[&](int a, int b) { return tracks[a].codec.cost < tracks[b].codec.cost; });
 	return true;
 }
 
@@ -1028,107 +1334,373 @@ double entropy(uint8_t *data, int size) {
 }
 
 
-bool Mp4::repair(string corrupt_filename, Mp4::MdatStrategy strategy, int64_t mdat_begin, bool skip_zeros, bool drifting) {
-	Log::info << "Repair: " << corrupt_filename << '\n';
-	BufferedAtom *mdat = NULL;
-	File file;
-	if(!file.open(corrupt_filename))
-		throw "Could not open file: " + corrupt_filename;
-
-	if(0) {  // Parse corrupt file.
-
+//first offset in [offset, end) where a few packets in a row are recognized, -1 if none.
+int64_t Mp4::resync(BufferedAtom *mdat, int64_t offset, int64_t end) {
+	const int MaxSkip = 1<<16;
+	const int Confirm = 8;
+	while(offset < end) {
+		int64_t current = offset;
+		int k = 0;
+		for(; k < Confirm && current < mdat->contentSize(); k++) {
+			MatchGroup group = match(current, mdat);
+			Match &best = group.back();
+			if(best.chances == 0.0f || best.length == 0)
+				break;
+			current += best.length;
+		}
+		if(k == Confirm)
+			return offset;
 
-		// Find mdat.  This fails with krois and a few other.
-		// TODO: Check for multiple mdat, or just look for the first one.
-		while(true) {
-			Atom atom;
-			try {
-				atom.parseHeader(file);
-			} catch(string) {
-				throw string("Failed to parse atoms in truncated file");
-			}
+		//jump to the next probable packet start.
+		int64_t maxlength64 = std::min(mdat->contentSize() - offset - 1, int64_t(MaxFrameLength));
+		if(maxlength64 <= 0)
+			break;
+		unsigned char *start = mdat->getFragment(offset + 1, maxlength64);
+		int maxskip = static_cast<int>(std::min(int64_t(MaxSkip), maxlength64));
+		int64_t next = -1;
+		for(Track &track: tracks) {
+			Match m = track.codec.search(start, static_cast<int>(maxlength64), maxskip);
+			if(m.chances != 0 && (next < 0 || m.offset < next))
+				next = m.offset;
+		}
+		offset += 1 + (next < 0 ? maxskip : next);
+	}
+	return -1;
+}
 
-			if(atom.name != string("mdat")) {
-				off_t pos = file.pos();
-				file.seek(pos - 8 + atom.length);
+//split mdat in segments walked in parallel, each by its own Mp4 sharing our parsed tracks
+//and the mdat mapping, but with its own decoders (codecs keep libav state).
+//Segments after the first start from a resync point and are kept only from the packet
+//where the walk of the previous ones lands (same offset, track and length), otherwise they are walked again.
+//Workers start with empty interleave history and tmcd already seen, and beam searches can't rewind
+//into the previous segment, so the result can differ from a single threaded scan.
+int64_t Mp4::scanSegments(string filename, BufferedAtom *mdat, vector<Packet> &packets) {
+	int64_t size = mdat->contentSize();
+	int64_t nthreads = threads > 0 ? threads : std::thread::hardware_concurrency();
+	nthreads = std::min(nthreads, size / MinSegmentSize);
+
+	//pcm can't be told apart from garbage, no way to resync in the middle of it.
+	bool haspcm = false;
+	for(Track &track: tracks)
+		haspcm |= track.codec.pcm;
+	if(nthreads < 2 || haspcm)
+		return scan(mdat, 0, size, packets);
+
+	struct Segment {
+		int64_t begin;
+		int64_t end;
+		int64_t stop = -1; //where the walk stopped, -1 if no resync point found.
+		vector<Packet> packets;
+		Mp4 *worker = nullptr;
+		BufferedAtom *mdat = nullptr;
+		string error;
+	};
+	vector<Segment> segments(nthreads);
+	auto cleanup = [&]() {
+		std::lock_guard<std::mutex> lock(libav_setup);
+		for(size_t i = 1; i < segments.size(); i++) {
+			delete segments[i].mdat;
+			delete segments[i].worker;
+		}
+	};
+
+	Log::info << "Scanning " << nthreads << " segments in parallel\n";
+	try {
+		for(int64_t i = 0; i < nthreads; i++) {
+			Segment &segment = segments[i];
+			segment.begin = i*(size/nthreads);
+			segment.end = (i == nthreads - 1) ? size : (i + 1)*(size/nthreads);
+			if(i == 0) {
+				segment.worker = this;
+				segment.mdat = mdat;
 				continue;
 			}
+			//libav setup is not thread safe: open the decoders here, one repair at a time.
+			segment.worker = new Mp4;
+			segment.worker->cancel = cancel;
+			{
+				std::lock_guard<std::mutex> lock(libav_setup);
+				segment.worker->share(*this);
+			}
+			for(Track &track: segment.worker->tracks)
+				track.codec.tmcd_seen = true; //only at the beginning.
 
-			mdat = new BufferedAtom(corrupt_filename);
-			mdat->start = atom.start;
-			memcpy(mdat->name, atom.name, sizeof(mdat->name)-1);
-			memcpy(mdat->head, atom.head, sizeof(mdat->head));
-			memcpy(mdat->version, atom.version, sizeof(mdat->version));
+			segment.mdat = new BufferedAtom(mdat);
+		}
+	} catch(string e) {
+		Log::error << "Could not set up parallel scan: " << e << "\n";
+		cleanup();
+		return scan(mdat, 0, size, packets);
+	}
 
-			mdat->file_begin = file.pos();
-			mdat->file_end   = file.length() - file.pos();
+	vector<std::thread> workers;
+	for(Segment &segment: segments) {
+		workers.emplace_back([&segment]() {
+			try {
+				int64_t begin = segment.begin;
+				if(begin > 0)
+					begin = segment.worker->resync(segment.mdat, begin, segment.end);
+				if(begin >= 0)
+					segment.stop = segment.worker->scan(segment.mdat, begin, segment.end, segment.packets, segment.begin == 0);
+			} catch(string e) {
+				segment.error = e;
+				segment.stop = -1;
+			} catch(const char *e) {
+				segment.error = e;
+				segment.stop = -1;
+			}
+		});
+	}
+	for(std::thread &worker: workers)
+		worker.join();
 
-			Log::debug << "MDAT SIZE: " << mdat->file_end - mdat->file_begin << endl;			//mdat->content = file.read(file.length() - file.pos());
+	if(segments[0].error.size()) {
+		cleanup();
+		throw segments[0].error;
+	}
+
+	//the walk so far must find the same packet the segment has there, not just one starting at the same offset.
+	auto lands = [&](const Packet &landing) {
+		int previous = -1;
+		int run = 0;
+		if(packets.size()) {
+			previous = packets.back().track;
+			for(auto p = packets.rbegin(); p != packets.rend() && p->track == previous && run < InterleaveModel::MaxRun; ++p)
+				run++;
+		}
+		MatchGroup group = match(landing.offset, mdat, previous, run);
+		Match &best = group.back();
+		if(best.chances == 0.0f)
+			return false;
+		int64_t length = best.length ? best.length : searchNext(mdat, landing.offset, 8192);
+		return best.id == landing.track && length == landing.length;
+	};
+
+	int64_t offset = segments[0].stop;
+	packets.insert(packets.end(), segments[0].packets.begin(), segments[0].packets.end());
+	for(size_t i = 1; i < segments.size(); i++) {
+		Segment &segment = segments[i];
+		if(offset < segment.begin) //we got lost before getting here.
 			break;
+		vector<Packet>().swap(segments[i-1].packets);
+
+		auto landing = lower_bound(segment.packets.begin(), segment.packets.end(), offset,
+			[](const Packet &packet, int64_t offset) { return packet.offset < offset; });
+		if(segment.stop >= 0 && landing != segment.packets.end() && landing->offset == offset && lands(*landing)) {
+			packets.insert(packets.end(), landing, segment.packets.end());
+			offset = segment.stop;
+		} else if(offset < segment.end) {
+			Log::debug << "Segment " << i << " does not stitch at: " << offset << ", scanning it again.\n";
+			offset = scan(mdat, offset, segment.end, packets, false);
 		}
-	} else {
-		mdat = new BufferedAtom(corrupt_filename);
+	}
+	cleanup();
+	return offset;
+}
 
-		int64_t mdat_offset = 0;
-		if(mdat_begin >= 0)
-			mdat_offset = mdat_begin;
-		else
-			mdat_offset = findMdat(mdat, strategy);
+//bytes at offset that can't be a packet (zero padding, atoms, rtp) and should be skipped, 0 if a packet might start here.
+int64_t Mp4::skipNonPacket(BufferedAtom *mdat, int64_t offset, bool haspcm) {
+	int64_t maxlength64 = mdat->contentSize() - offset;
+	if(maxlength64 > MaxFrameLength)
+		maxlength64 = MaxFrameLength;
+	if(maxlength64 < 8)
+		return 0;
+	unsigned char *start = mdat->getFragment(offset, maxlength64);
+	int maxlength = static_cast<int>(maxlength64);
+	unsigned int begin = readBE<int>(start);
+
+	//zeros in pcm are possible, if mixed with zero padding it becames impossible to correctly detect the start.
+	if(begin == 0 && !haspcm) {
+		int64_t skipped = zeroskip(mdat, start, maxlength64);
+		while((offset + skipped + mdat->file_begin) % 256)
+			skipped++;
+		Log::debug << "Skipped: " << skipped << endl;
+		return skipped;
+	}
 
-		if(mdat_offset < 0) {
-			Log::debug << "Failed finding start" << endl;
-			return false;
-		}
+	//skip internal atoms
+	if(!strncmp("moov", (char *)start + 4, 4) ||
+		!strncmp("free", (char *)start + 4, 4) ||
+		!strncmp("hoov", (char *)start + 4, 4) ||
+		!strncmp("moof", (char *)start + 4, 4) ||
+		!strncmp("wide", (char *)start + 4, 4)) {
 
-		mdat->start = mdat_offset;
-		mdat->content_start = mdat_offset;
-		memcpy(mdat->name, "mdat", 5);
-		//	memcpy(mdat->head, atom.head, sizeof(mdat->head));
-		//memcpy(mdat->version, atom.version, sizeof(mdat->version));gedit
-		file.seek(mdat_offset);
-		mdat->file_begin = file.pos();
-		mdat->file_end   = file.length();
+		Log::debug << "Skipping containers for all the meta-data atom (moov, free, wide): begin: 0x"
+				   << hex << begin << dec << ".\n";
+		return begin;
 	}
 
-	Log::debug << "Mdat start: " << mdat->file_begin << " end: " << mdat->file_end << endl;
+	if(!strncmp("mdat", (char *)start + 4, 4)) {
+		Log::debug << "Mdat encoutered, skipping header\n";
+		return 8;
+	}
+
+	//skip RTP:
+	if(begin && 0xff00ffff) { // && readBE<uint16_t>(start);
+		Match match = Codec::rtpMatch(start, maxlength);
+		if(match.chances) {
+			Log::debug << "Rtp packets. Lenght: " << match.length << "\n";
+			return match.length;
+		}
+	}
+
+	//skip MISOUDAT: seen in a free container, but repeated just after outside of the free.
+	if(!strncmp("MISOUDAT", (char *)start, 8))
+		return 72;
+	return 0;
+}
+
+//the walk got lost at offset lost: look for the most probable sequence of packets, starting a few
+//packets back, that gets past it. A path scores the mean of log(chances/(1 + chances)) over its packets,
+//the best BeamWidth paths are kept at each step and paths of a step landing on the same offset are merged.
+//On success the rewound packets are replaced by the path and offset is where it ends.
+bool Mp4::beamSearch(BufferedAtom *mdat, int64_t lost, std::vector<Packet> &packets, int64_t &offset, bool haspcm) {
+	const size_t Rewind = 8;
+	const size_t BeamWidth = 8;
+	const int Candidates = 3;  //per packet.
+	const int Confirm = 4;     //packets past the lost offset to trust a path.
+	const int MaxSteps = 64;
+
+	size_t first = packets.size() > Rewind ? packets.size() - Rewind : 0;
+	int64_t begin = first < packets.size() ? packets[first].offset : lost;
+
+	//tmcd happens once: if rewound it might be found again.
+	int tmcd_id = -1;
 	for(unsigned int i = 0; i < tracks.size(); ++i)
-		tracks[i].clear();
+		if(string(tracks[i].codec.name) == "tmcd")
+			tmcd_id = i;
+	bool tmcd_rewound = false;
+	for(size_t i = first; i < packets.size(); i++)
+		tmcd_rewound |= packets[i].track == tmcd_id;
+	if(tmcd_rewound)
+		tracks[tmcd_id].codec.tmcd_seen = false;
+
+	struct Node {
+		int parent;
+		Packet packet;
+	};
+	//paths in the beam can hold a different number of packets (skips add none, lengths differ):
+	// compare the log chances per packet, a sum would favour the paths with fewer.
+	struct Path {
+		int node;       //last packet, -1 if none yet.
+		int64_t offset;
+		double score;   //sum of the log chances of the packets.
+		int past;       //packets starting at or after the lost offset.
+		int packets;
+		double mean() const { return packets ? score/packets : 0.0; }
+		bool operator<(const Path &p) const { return mean() > p.mean(); }
+	};
+	vector<Node> nodes;
+	vector<Path> frontier = { { -1, begin, 0.0, 0, 0 } };
+	Path best = { -1, 0, -numeric_limits<double>::infinity(), 0, 1 };
+	bool found = false;
+
+	for(int step = 0; step < MaxSteps && frontier.size(); step++) {
+		vector<Path> next;
+		for(Path &path: frontier) {
+			if(path.offset > mdat->contentSize()) //skipped past the end.
+				continue;
+			if(path.past >= Confirm || (path.offset > lost && mdat->contentSize() - path.offset < 65000)) {
+				if(path.mean() > best.mean()) {
+					best = path;
+					found = true;
+				}
+				continue;
+			}
+			if(path.offset >= mdat->contentSize())
+				continue;
 
+			int64_t skip = skipNonPacket(mdat, path.offset, haspcm);
+			if(skip) {
+				Path skipped = path;
+				skipped.offset += skip;
+				if(skipped.offset > lost) //the walk can go on from here.
+					skipped.past = Confirm;
+				next.push_back(skipped);
+				continue;
+			}
 
-	// mp4a can be decoded and reports the number of samples (duration in samplerate scale).
-	// In some videos the duration (stts) can be variable and we can rebuild them using these values.
-	vector<int> audiotimes;
-	//TODO: if it fails, try again with the same offset as the good one.
-	//carefu the offset is relative to mdat, use the same absolute position.
-	int64_t offset = 0;
+			MatchGroup group = match(path.offset, mdat);
+			int taken = 0;
+			for(auto m = group.rbegin(); m != group.rend() && taken < Candidates; ++m) {
+				if(m->chances <= 0.0f)
+					break;
+				Packet packet(path.offset, *m);
+				if(!packet.length)
+					packet.length = searchNext(mdat, path.offset, 8192);
+				if(!packet.length || mdat->file_begin + path.offset + packet.length > mdat->file_end)
+					continue;
+				taken++;
+
+				nodes.push_back({ path.node, packet });
+				Path extended;
+				extended.node = int(nodes.size()) - 1;
+				extended.offset = path.offset + packet.length;
+				extended.score = path.score - log1p(1.0/m->chances);
+				extended.past = path.past + (path.offset >= lost);
+				extended.packets = path.packets + 1;
+				next.push_back(extended);
+			}
+		}
 
+		//keep the best paths of this step, only one for each offset.
+		// The mean can still improve with more packets: go on until every path is confirmed or dead.
+		sort(next.begin(), next.end());
+		frontier.clear();
+		unordered_set<int64_t> visited;
+		for(Path &path: next) {
+			if(frontier.size() >= BeamWidth)
+				break;
+			if(!visited.insert(path.offset).second)
+				continue;
+			frontier.push_back(path);
+		}
+	}
 
-//GOPRO TMCD is a single packet with a timestamp
+	if(!found) {
+		Log::debug << "Beam search failed after offset: " << begin << "\n";
+		return false;
+	}
 
+	vector<Packet> path;
+	for(int n = best.node; n >= 0; n = nodes[n].parent)
+		path.push_back(nodes[n].packet);
+	Log::debug << "Beam search replaced " << packets.size() - first << " packets with " << path.size() << "\n";
+
+	packets.resize(first);
+	packets.insert(packets.end(), path.rbegin(), path.rend());
+	offset = best.offset;
+
+	if(tmcd_id >= 0) {
+		bool tmcd_found = false;
+		for(Packet &packet: path)
+			tmcd_found |= packet.track == tmcd_id;
+		if(tmcd_found || tmcd_rewound)
+			tracks[tmcd_id].codec.tmcd_seen = tmcd_found;
+	}
+	return true;
+}
+
+//walk the packets from offset until end (the last one might cross it) or until we get lost.
+//Returns the offset where the walk stopped.
+int64_t Mp4::scan(BufferedAtom *mdat, int64_t offset, int64_t end, std::vector<Packet> &packets, bool progress) {
+//GOPRO TMCD is a single packet with a timestamp
 	bool haspcm = false;
 	int tmcd_id = -1;
 	for(unsigned int i = 0; i < tracks.size(); ++i) {
 		Track &track = tracks[i];
-		if(string(track.codec.name) == "tmcd") {
+		if(string(track.codec.name) == "tmcd")
 			tmcd_id = i;
-			track.codec.tmcd_seen = false; //tmcd happens only once, but if we try twice we need to reset it.
-		}
 		if(track.codec.pcm)
 			haspcm = true;
-
-
 	}
 
-
-	std::vector<MatchGroup> matches;
-
-
 	int percent = 0;
-	//keep track of how many backtraced.
-	int backtracked = 0;
-	while(offset <  mdat->contentSize()) {
+	while(offset < end) {
+		if(cancel && cancel->load(std::memory_order_relaxed))
+			break;
 		int p = 100*offset / mdat->contentSize();
-		if(p > percent) {
+		if(progress && p > percent) {
 			percent = p;
 			Log::info << "Processed: " << percent << "%\n";
 		}
@@ -1147,63 +1719,9 @@ bool Mp4::repair(string corrupt_filename, Mp4::MdatStrategy strategy, int64_t md
 					   << "  begin: " << hex << setw(8) << begin << ' ' << setw(8) << next << dec << '\n';
 
 
-		//zeros in pcm are possible, if mixed with zero padding it becames impossible to correctly detect the start.
-		if(begin == 0 && !haspcm) {
-
-			int skipped = zeroskip(mdat, start, maxlength64);
-/*			if(skipped) {
-				Log::debug << "Skipping " << skipped << " zeroes!" << endl;
-				offset += skipped;
-				continue;
-			} */
-
-			cout << (offset + skipped + mdat->file_begin) << " vs: " << (offset + skipped + mdat->file_begin) % 256 << endl;
-			while((offset + skipped + mdat->file_begin) % 256)
-				skipped++;
-			Log::debug << "Skipped: " << skipped << endl;
-			offset += skipped;
-			continue;
-
-		}
-
-
-
-		Log::flush();
-		//skip internal atoms
-		if(!strncmp("moov", (char *)start + 4, 4) ||
-			!strncmp("free", (char *)start + 4, 4) ||
-			!strncmp("hoov", (char *)start + 4, 4) ||
-			!strncmp("moof", (char *)start + 4, 4) ||
-			!strncmp("wide", (char *)start + 4, 4)) {
-
-			Log::debug << "Skipping containers for all the meta-data atom (moov, free, wide): begin: 0x"
-					   << hex << begin << dec << ".\n";
-			offset += begin;
-			continue;
-		}
-
-		if(!strncmp("mdat", (char *)start + 4, 4)) {
-			Log::debug << "Mdat encoutered, skipping header\n";
-			offset += 8;
-			continue;
-		}
-
-		//skip RTP:
-		if(begin && 0xff00ffff) { // && readBE<uint16_t>(start);
-			if((mdat->file_begin + offset) == 129770)
-				Log::debug << "RTP test\n";
-			//testing up to
-			Match match = Codec::rtpMatch(start, maxlength);
-			if(match.chances) {
-				Log::debug << "Rtp packets. Lenght: " << match.length << "\n";
-				offset += match.length;
-				continue;
-			}
-		}
-
-		//skip MISOUDAT: seen in a free container, but repeated just after outside of the free.
-		if(!strncmp("MISOUDAT", (char *)start, 8)) {
-			offset += 72;
+		int64_t skip = skipNonPacket(mdat, offset, haspcm);
+		if(skip) {
+			offset += skip;
 			continue;
 		}
 
@@ -1223,7 +1741,14 @@ bool Mp4::repair(string corrupt_filename, Mp4::MdatStrategy strategy, int64_t md
 		if(offset + mdat->content_start == 52087808)
 			cout << "AHGH" << endl;
 
-		MatchGroup group = match(offset, mdat);
+		int previous = -1;
+		int run = 0;
+		if(packets.size()) {
+			previous = packets.back().track;
+			for(auto p = packets.rbegin(); p != packets.rend() && p->track == previous && run < InterleaveModel::MaxRun; ++p)
+				run++;
+		}
+		MatchGroup group = match(offset, mdat, previous, run);
 
 		Match &best = group.back();
 
@@ -1243,6 +1768,7 @@ bool Mp4::repair(string corrupt_filename, Mp4::MdatStrategy strategy, int64_t md
 		Match &best = group.back(); */
 		//no hope!
 		if(best.chances == 0.0f) {
+			sure_packets = 0;
 
 			if(offset == 0) { //failed on first packet, maybe mdat starts at + 8
 				offset = 8;
@@ -1264,46 +1790,15 @@ bool Mp4::repair(string corrupt_filename, Mp4::MdatStrategy strategy, int64_t md
 				Log::debug << "We are at the end of the file: " << offset << endl;
 				break;
 			}
-			//look for a different candidate in the past matches
-			while(backtracked < 7) {
-
-				if(matches.size() == 0) {
-					backtracked = 7;
-					break;
-				}
-
-				backtracked++;
-
-				MatchGroup &last = matches.back();
-				if(best.id == tmcd_id)
-					tracks[best.id].codec.tmcd_seen = false;
-
-				//last packet found in previous group wasn't good.
-				last.pop_back();
-
-				if(last.size() == 0) {
-					//we need to go to the previous group
-					matches.pop_back();
-					continue;
-				}
-				Match &candidate = last.back();
-				if(candidate.chances > 0.0f && candidate.length > 0 ) {
-					if(candidate.id == tmcd_id)
-						tracks[candidate.id].codec.tmcd_seen = true;
-					offset = last.offset + candidate.length;
-					break;
-				}
-				//no luck either, try another one looping
-			}
-			if(backtracked >= 7) {
-				Log::error << "Backtracked enough!" << endl;
+			//look for a better sequence of packets from a few packets back.
+			if(!beamSearch(mdat, offset, packets, offset, haspcm)) {
+				Log::error << "Could not find a way past offset: " << offset << endl;
 				break;
 			}
 
 			//we changed the offset lets restart.
 			continue;
 		}
-		backtracked = 0;
 
 		if(mdat->file_begin + offset + best.length > mdat->file_end)
 			break;
@@ -1326,10 +1821,127 @@ bool Mp4::repair(string corrupt_filename, Mp4::MdatStrategy strategy, int64_t md
 		}
 		if(best.id == tmcd_id)
 			tracks[best.id].codec.tmcd_seen = true; //id in tracks start from 1.
-		matches.push_back(group);
+		packets.push_back(Packet(group.offset, best));
+		sure_packets++;
+	}
+	return offset;
+}
+
+bool Mp4::repair(string corrupt_filename, Mp4::MdatStrategy strategy, int64_t mdat_begin, bool skip_zeros, bool drifting) {
+	Log::info << "Repair: " << corrupt_filename << '\n';
+	BufferedAtom *mdat = NULL;
+	File file;
+	if(!file.open(corrupt_filename))
+		throw "Could not open file: " + corrupt_filename;
+
+	if(0) {  // Parse corrupt file.
+
+
+		// Find mdat.  This fails with krois and a few other.
+		// TODO: Check for multiple mdat, or just look for the first one.
+		while(true) {
+			Atom atom;
+			try {
+				atom.parseHeader(file);
+			} catch(string) {
+				throw string("Failed to parse atoms in truncated file");
+			}
+
+			if(atom.name != string("mdat")) {
+				off_t pos = file.pos();
+				file.seek(pos - 8 + atom.length);
+				continue;
+			}
+
+			mdat = new BufferedAtom(corrupt_filename);
+			mdat->start = atom.start;
+			memcpy(mdat->name, atom.name, sizeof(mdat->name)-1);
+			memcpy(mdat->head, atom.head, sizeof(mdat->head));
+			memcpy(mdat->version, atom.version, sizeof(mdat->version));
+
+			mdat->file_begin = file.pos();
+			mdat->file_end   = file.length() - file.pos();
+
+			Log::debug << "MDAT SIZE: " << mdat->file_end - mdat->file_begin << endl;			//mdat->content = file.read(file.length() - file.pos());
+			break;
+		}
+	} else {
+		mdat = new BufferedAtom(corrupt_filename);
+
+		int64_t mdat_offset = 0;
+		if(mdat_begin >= 0)
+			mdat_offset = mdat_begin;
+		else
+			mdat_offset = findMdat(mdat, strategy);
+
+		if(mdat_offset < 0) {
+			Log::debug << "Failed finding start" << endl;
+			return false;
+		}
+
+		mdat->start = mdat_offset;
+		mdat->content_start = mdat_offset;
+		memcpy(mdat->name, "mdat", 5);
+		//	memcpy(mdat->head, atom.head, sizeof(mdat->head));
+		//memcpy(mdat->version, atom.version, sizeof(mdat->version));gedit
+		file.seek(mdat_offset);
+		mdat->file_begin = file.pos();
+		mdat->file_end   = file.length();
 	}
 
-	if(matches.size() < 4) //to few packets.
+	Log::debug << "Mdat start: " << mdat->file_begin << " end: " << mdat->file_end << endl;
+	for(unsigned int i = 0; i < tracks.size(); ++i)
+		tracks[i].clear();
+
+	//expect each track to fill mdat in the same proportion as in the working file.
+	int64_t reference_size = 0;
+	for(Track &track: tracks)
+		reference_size += track.codec.stats.total_size;
+	for(Track &track: tracks) {
+		CodecStats &stats = track.codec.stats;
+		if(!reference_size || stats.average_size < 1)
+			continue;
+		double share = stats.total_size / double(reference_size);
+		track.reserve(size_t(mdat->contentSize() * share / stats.average_size));
+	}
+
+
+	// mp4a can be decoded and reports the number of samples (duration in samplerate scale).
+	// In some videos the duration (stts) can be variable and we can rebuild them using these values.
+	vector<int> audiotimes;
+
+	for(Track &track: tracks)
+		if(string(track.codec.name) == "tmcd")
+			track.codec.tmcd_seen = false; //tmcd happens only once, but if we try twice we need to reset it.
+
+	//results from a previous attempt came from a different mdat.
+	match_cache.clear();
+
+	//committed packets.
+	std::vector<Packet> packets;
+	{
+		size_t expected = 0;
+		for(Track &track: tracks)
+			expected += track.chunk_sizes.capacity();
+		packets.reserve(expected);
+	}
+
+	//TODO: if it fails, try again with the same offset as the good one.
+	//carefu the offset is relative to mdat, use the same absolute position.
+	sure_packets = 0;
+	int64_t offset = scanSegments(corrupt_filename, mdat, packets);
+
+	recovered = 0;
+	for(Packet &packet: packets)
+		recovered += packet.length;
+	reached_end = mdat->contentSize() - offset < 65000;
+
+	//a racer stopped after reaching the end still has the whole file.
+	if(cancel && *cancel && !reached_end) {
+		delete mdat;
+		return false;
+	}
+	if(packets.size() < 4) //to few packets.
 		return false;
 
 
@@ -1340,23 +1952,22 @@ bool Mp4::repair(string corrupt_filename, Mp4::MdatStrategy strategy, int64_t md
 
 
 	int start = -1;
-	for(int i = 0; i < matches.size(); i++) {
-		MatchGroup &g = matches[i];
-		Match &m = g.back();
-		if(m.id != 0 && start == -1)
+	for(int i = 0; i < packets.size(); i++) {
+		Packet &m = packets[i];
+		if(m.track != 0 && start == -1)
 			start = i;
-		if(m.id == 0) {
+		if(m.track == 0) {
 
 
 			if(start != -1) {
 				int tot_audio = i - start;
 				for(int k = start; k < start + tot_audio/2; k++) {
-					assert(matches[k].back().id != 0);
-					matches[k].back().id = 1;
+					assert(packets[k].track != 0);
+					packets[k].track = 1;
 				}
 				for(int k = start + tot_audio/2; k < start + tot_audio; k++) {
-					assert(matches[k].back().id != 0);
-					matches[k].back().id = 2;
+					assert(packets[k].track != 0);
+					packets[k].track = 2;
 				}
 			}
 			start = -1;
@@ -1373,12 +1984,11 @@ bool Mp4::repair(string corrupt_filename, Mp4::MdatStrategy strategy, int64_t md
 #ifdef DOUBLEAUDIO_INTERLEAVED
 
 	bool first = true;
-	for(int i = 0; i < matches.size(); i++) {
-		MatchGroup &g = matches[i];
-		Match &m = g.back();
-		if(m.id == 0)
+	for(int i = 0; i < packets.size(); i++) {
+		Packet &m = packets[i];
+		if(m.track == 0)
 			continue;
-		first ? m.id = 1 : m.id = 2;
+		first ? m.track = 1 : m.track = 2;
 		first = !first;
 	}
 #endif
@@ -1390,18 +2000,17 @@ bool Mp4::repair(string corrupt_filename, Mp4::MdatStrategy strategy, int64_t md
 
 
 		int start = -1;
-		for(int i = 0; i < matches.size(); i++) {
-			MatchGroup &g = matches[i];
-			Match &m = g.back();
-			if(m.id != 0 && start == -1)
+		for(int i = 0; i < packets.size(); i++) {
+			Packet &m = packets[i];
+			if(m.track != 0 && start == -1)
 				start = i;
-			if(m.id == 0) {
+			if(m.track == 0) {
 
 				if(start != -1) {
 					int tot_audio = i - start;
 					for(int k = 0; k < tot_audio; k++) {
-						assert(matches[k + start].back().id != 0);
-						matches[k+start].back().id = (k%4)+1;
+						assert(packets[k + start].track != 0);
+						packets[k+start].track = (k%4)+1;
 					}
 				}
 				start = -1;
@@ -1411,20 +2020,17 @@ bool Mp4::repair(string corrupt_filename, Mp4::MdatStrategy strategy, int64_t md
 #endif
 
 
-	//copy matches into tracks
+	//copy packets into tracks
 	int count = 0;
 	double drift = 0; //difference in times between audio and video.
 	double audio_current = 0;
 	double video_current = 0;
-	for(MatchGroup &group: matches) {
-		assert(group.size() > 0);
-		Match &match = group.back();
-
-		Track &track = tracks[match.id];
+	for(Packet &match: packets) {
+		Track &track = tracks[match.track];
 		if(match.keyframe)
 			track.keyframes.push_back(track.offsets.size());
 
-		track.offsets.push_back(group.offset);
+		track.offsets.push_back(match.offset);
 		if(track.default_size) {
 			//if number of samples per chunk is variable, encode each sample in a different chunk.
 			if(track.default_chunk_nsamples == 0) {
@@ -1487,7 +2093,8 @@ bool Mp4::repair(string corrupt_filename, Mp4::MdatStrategy strategy, int64_t md
 	mdat->file_end = mdat->file_begin + offset;
 	mdat->length   = mdat->file_end - mdat->file_begin;
 
-	Log::info << "Found " << matches.size() << " packets.\n";
+	Log::info << "Found " << packets.size() << " packets.\n";
+	vector<Packet>().swap(packets);
 
 	for(unsigned int i = 0; i < tracks.size(); ++i) {
 		Log::info << "Found " << tracks[i].offsets.size() << " chunks for " << tracks[i].codec.name << endl;
@@ -1495,6 +2102,7 @@ bool Mp4::repair(string corrupt_filename, Mp4::MdatStrategy strategy, int64_t md
 			swap(audiotimes, tracks[i].times);
 		if(tracks[i].offsets.size())
 			tracks[i].fixTimes();
+		tracks[i].mergeChunks();
 	}
 
 	Atom *original_mdat = root->atomByName("mdat");
@@ -1509,7 +2117,7 @@ bool Mp4::repair(string corrupt_filename, Mp4::MdatStrategy strategy, int64_t md
 	root->replace(original_mdat, mdat);
 	//original_mdat->content.swap(mdat->content);
 	//original_mdat->start = -8;
-	delete original_mdat;
+	Atom::destroy(original_mdat);
 
 	return true;
 }
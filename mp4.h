@@ -24,6 +24,9 @@
 
 #include <vector>
 #include <string>
+#include <atomic>
+#include <list>
+#include <unordered_map>
 
 #include "track.h"
 class File;
@@ -34,6 +37,59 @@ class BufferedAtom;
 struct AVFormatContext;
 
 
+//a packet committed during repair: the matches it was chosen among are not kept.
+struct Packet {
+	int64_t offset;        //relative to mdat content.
+	uint32_t length;
+	uint32_t duration;     //as reported by the codec, 0 if unknown.
+	uint16_t track;
+	bool keyframe;
+
+	Packet() {}
+	Packet(int64_t offset, const Match &m):
+		offset(offset), length(m.length), duration(m.duration), track(m.id), keyframe(m.keyframe) {}
+};
+
+//results of codec matches by absolute offset in the file and track, the least recently used are dropped.
+//An entry is valid only while the codec is in the same state (see Codec::stamp).
+class MatchCache {
+public:
+	static const size_t Capacity = 1<<16;
+
+	bool get(const BufferedAtom *mdat, int64_t offset, int track, int stamp, Match &match);
+	void put(const BufferedAtom *mdat, int64_t offset, int track, int stamp, const Match &match);
+	void clear();
+
+protected:
+	struct Entry {
+		uint64_t key;
+		int stamp;
+		Match match;
+	};
+	const BufferedAtom *source = nullptr; //entries are for this mdat only.
+	std::list<Entry> entries;             //most recently used first.
+	std::unordered_map<uint64_t, std::list<Entry>::iterator> index;
+};
+
+
+//which track comes next, learned from the order of the chunks in the working file.
+//The state is the last track and how many packets in a row it had, up to MaxRun.
+class InterleaveModel {
+public:
+	static const int MaxRun = 16;
+
+	void learn(std::vector<Track> &tracks);
+	bool empty() const { return totals.empty(); }
+	//most likely track after run packets of track, -1 if never seen.
+	int predict(int track, int run, float &probability) const;
+
+protected:
+	int ntracks = 0;
+	std::vector<uint32_t> counts; //[track][run][next]
+	std::vector<uint32_t> totals; //[track][run]
+};
+
+
 class Mp4 {
 public:
     int timescale;
@@ -46,6 +102,15 @@ public:
 		SPECIFIED //user supplied start.
 	};
 
+    static int threads; //repair scans this many mdat segments in parallel (default 1), 0 for one per core.
+
+    static float certainty; //chances of a match good enough to skip the other tracks, 0 to match all.
+
+    const std::atomic<bool> *cancel; //if set and raised, repair gives up as soon as possible (unless it reached the end).
+    std::atomic<int64_t> sure_packets; //packets matched in a row by the running repair, since the last failed match.
+    int64_t recovered;  //bytes of packets found by the last repair.
+    bool reached_end;   //the last repair walked up to the end of the file.
+
     Mp4();
     ~Mp4();
 
@@ -59,7 +124,8 @@ public:
 	BufferedAtom *bufferedMdat(Atom *mdat);
 
 
-    bool save     (std::string output_filename);
+    //in_place: output_filename is the repaired file, moov is appended to it.
+    bool save     (std::string output_filename, bool in_place = false);
     bool saveVideo(std::string output_filename) { return save(output_filename); }
 
     void printMediaInfo();
@@ -73,15 +139,30 @@ public:
 
 protected:
     std::string file_name;
+    File *source; //the reference file: atoms load their content from it when first used.
     Atom *root;
     AVFormatContext *context;
     std::vector<Track> tracks;
+    InterleaveModel interleave;
+    std::vector<int> match_order; //tracks from the cheapest matcher.
+    MatchCache match_cache;
+    std::vector<AVCodecContext *> codec_contexts; //decoders of a segment worker (see share), freed on close.
 
     void close();
+    void share(const Mp4 &parent);
     bool parseTracks();
     void writeTracksToAtoms();
 
-	MatchGroup match(int64_t offset, BufferedAtom *mdat);
+	//match the tracks from the cheapest, stopping at the first (likely or cheap) one matching with certainty
+	//that no track left could beat: the best match is the same as matching them all.
+	//previous: track of the last packet (if known) and how many in a row, to try the likely one first.
+	MatchGroup match(int64_t offset, BufferedAtom *mdat, int previous = -1, int run = 0);
+	bool beatable(float chances, int k, int likely);
+	int64_t scan(BufferedAtom *mdat, int64_t offset, int64_t end, std::vector<Packet> &packets, bool progress = true);
+	int64_t scanSegments(std::string filename, BufferedAtom *mdat, std::vector<Packet> &packets);
+	int64_t resync(BufferedAtom *mdat, int64_t offset, int64_t end);
+	int64_t skipNonPacket(BufferedAtom *mdat, int64_t offset, bool haspcm);
+	bool beamSearch(BufferedAtom *mdat, int64_t lost, std::vector<Packet> &packets, int64_t &offset, bool haspcm);
 };
 
 #endif // MP4_H
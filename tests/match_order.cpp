@@ -0,0 +1,118 @@
+//==================================================================//
+/*
+    Untrunc - tests/match_order.cpp
+
+    Matching of a reference with an mebx and an hvc1 track: mebx is cheaper
+    and tried first, it must not keep an HEVC packet that starts with a short
+    NAL (mebx gives such packets 5e7 chances, hvc1 1e10).
+
+    Build and run from the repository root, like untrunc in the Dockerfile:
+        g++ -std=c++17 -o match_order tests/match_order.cpp \
+            atom.cpp mp4.cpp file.cpp track.cpp log.cpp codec.cpp codec_*.cpp codecstats.cpp \
+            -I./libav-12.3 \
+            -L./libav-12.3/libavformat -lavformat -L./libav-12.3/libavcodec -lavcodec \
+            -L./libav-12.3/libavresample -lavresample -L./libav-12.3/libavutil -lavutil \
+            -lpthread -lz
+        ./match_order
+                                                                    */
+//==================================================================//
+
+#include "../mp4.h"
+#include "../atom.h"
+#include "../track.h"
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+//access to the matching internals of Mp4.
+class MatchMp4: public Mp4 {
+public:
+	using Mp4::tracks;
+	using Mp4::match_order;
+	using Mp4::match;
+};
+
+//a trak with just the sample description of codec.
+static Atom *makeTrak(const char *codec) {
+	Atom *trak = new Atom;
+	memcpy(trak->name, "trak", 5);
+	Atom *stsd = new Atom;
+	memcpy(stsd->name, "stsd", 5);
+	stsd->content.assign(16, 0);
+	stsd->writeInt(1, 4);   //entries
+	stsd->writeInt(8, 8);   //size of the description
+	memcpy(&stsd->content[12], codec, 4);
+	trak->addChild(stsd);
+	return trak;
+}
+
+static int failures = 0;
+static void check(bool ok, const char *what) {
+	if(!ok) {
+		printf("FAILED: %s\n", what);
+		failures++;
+	}
+}
+
+int main() {
+	//two hevc slices of 20 bytes (length 16 fits mebx), each the first of its picture.
+	vector<unsigned char> data(4096, 0);
+	for(int i = 0; i < 2; i++) {
+		unsigned char *nal = &data[20*i];
+		writeBE<uint32_t>(nal, 16);
+		nal[4] = 1 << 1; //TRAIL_R
+		nal[5] = 1;      //temporal id + 1
+		nal[6] = 0x80;   //first slice segment in picture
+	}
+	unsigned char crec[12] = { 0, 0, 0, 100, 0, 0, 0, 1, 'c', 'r', 'e', 'c' };
+	memcpy(&data[200], crec, sizeof(crec));
+
+	string filename = "match_order.tmp";
+	FILE *out = fopen(filename.c_str(), "wb");
+	if(!out || fwrite(data.data(), 1, data.size(), out) != data.size()) {
+		printf("Could not write %s\n", filename.c_str());
+		return 1;
+	}
+	fclose(out);
+
+	vector<Atom *> traks = { makeTrak("mebx"), makeTrak("hvc1") };
+	MatchMp4 mp4;
+	for(Atom *trak: traks) {
+		Track track;
+		check(track.codec.parse(trak), "parse stsd");
+		mp4.tracks.push_back(track);
+	}
+	mp4.match_order = { 0, 1 }; //mebx is cheaper.
+
+	BufferedAtom *mdat = new BufferedAtom(filename);
+	mdat->file_begin = 0;
+	mdat->file_end = data.size();
+
+	float certainty = Mp4::certainty;
+	for(float c: { certainty, 0.0f, 1e30f }) {
+		Mp4::certainty = c;
+		MatchGroup group = mp4.match(0, mdat);
+		check(group.back().id == 1, "HEVC packet matched as hvc1");
+		check(group.back().length == 20, "HEVC packet length");
+	}
+	Mp4::certainty = certainty;
+
+	//a real mebx packet is still certain enough to skip hvc1.
+	MatchGroup group = mp4.match(200, mdat);
+	check(group.size() == 1 && group.back().id == 0, "mebx crec packet stops at mebx");
+
+	delete mdat;
+	mp4.tracks.clear();
+	for(Atom *trak: traks)
+		Atom::destroy(trak);
+	remove(filename.c_str());
+
+	if(failures)
+		return 1;
+	printf("ok\n");
+	return 0;
+}
@@ -22,6 +22,8 @@
 #include <vector>
 #include <string>
 #include <iostream>
+#include <algorithm>
+#include <functional>
 
 
 #include "track.h"
@@ -34,6 +36,24 @@ using namespace std;
 
 
 // Track.
+void OffsetTable::widen() {
+	if(!wide.empty() || narrow.empty())
+		return;
+	wide.reserve(narrow.capacity());
+	wide.assign(narrow.begin(), narrow.end());
+	narrow.clear();
+	narrow.shrink_to_fit();
+}
+
+int64_t OffsetTable::max() const {
+	if(empty())
+		return 0;
+	if(wide.empty())
+		return base + *max_element(narrow.begin(), narrow.end());
+	return base + *max_element(wide.begin(), wide.end());
+}
+
+
 Track::Track() : trak(nullptr), timescale(0), duration(0) { }
 
 void Track::cleanUp() {
@@ -43,6 +63,7 @@ void Track::cleanUp() {
 	offsets.clear();
 	chunks.clear();
 	sample_sizes.clear();
+	reference_sizes = BigEndianTable<int32_t>();
 	keyframes.clear();
 	times.clear();
 	codec.clear();
@@ -80,9 +101,9 @@ bool Track::parse(Atom *t) {
 	getChunkOffsets(t);
 	getSampleToChunk(t);
 
-	if(!default_time && !default_size && times.size() != sample_sizes.size()) {
+	if(!default_time && !default_size && times.size() != reference_sizes.size()) {
 		Log::info << "Mismatch between time offsets and size offsets.\n";
-		Log::debug << "Time offsets: " << times.size() << " Size offsets: " << sample_sizes.size() << '\n';
+		Log::debug << "Time offsets: " << times.size() << " Size offsets: " << reference_sizes.size() << '\n';
 	}
 	//assert(times.size() == sizes.size());
 /*	if(!default_time && times.size() != sample_to_chunk.size()) {
@@ -237,7 +258,10 @@ void Track::writeToAtoms() {
 void Track::clear() {
 	nsamples = 0;
 	offsets.clear();
+	chunk_sizes.clear();
+	chunk_nsamples.clear();
 	sample_sizes.clear();
+	reference_sizes = BigEndianTable<int32_t>(); //stsz gets rewritten.
 	keyframes.clear();
 	//times.clear();
 }
@@ -262,6 +286,42 @@ void Track::fixTimes() {
 	}
 }
 
+void Track::reserve(size_t npackets) {
+	offsets.reserve(npackets);
+	chunk_sizes.reserve(npackets);
+	if(!default_size)
+		sample_sizes.reserve(npackets);
+}
+
+// Merge runs of contiguous packets into multi sample chunks (samples are unchanged).
+// Only where stsc can describe the result: one sample per packet, or pcm.
+void Track::mergeChunks() {
+	bool pcm_chunks = default_size && default_chunk_nsamples == 0 && codec.pcm;
+	if(!(default_size == 0 || pcm_chunks) || offsets.empty() || chunk_sizes.size() != offsets.size())
+		return;
+
+	const int32_t MaxChunkSize = 1<<24;
+	OffsetTable     merged_offsets;
+	vector<int32_t> merged_sizes;
+	vector<int32_t> merged_nsamples;
+	for(unsigned int i = 0; i < offsets.size(); i++) {
+		if(merged_offsets.size() && merged_offsets.back() + merged_sizes.back() == offsets[i] &&
+				merged_sizes.back() + int64_t(chunk_sizes[i]) <= MaxChunkSize) {
+			merged_sizes.back() += chunk_sizes[i];
+			merged_nsamples.back()++;
+		} else {
+			merged_offsets.push_back(offsets[i]);
+			merged_sizes.push_back(chunk_sizes[i]);
+			merged_nsamples.push_back(1);
+		}
+	}
+	Log::debug << "Merged " << offsets.size() << " packets into " << merged_offsets.size() << " chunks for " << codec.name << "\n";
+	offsets.swap(merged_offsets);
+	chunk_sizes.swap(merged_sizes);
+	if(default_size == 0)
+		chunk_nsamples.swap(merged_nsamples); //pcm counts samples from the chunk size.
+}
+
 void Track::getSampleTimes(Atom *t) {
 	assert(t != NULL);
 	times.clear();
@@ -271,10 +331,14 @@ void Track::getSampleTimes(Atom *t) {
 		throw string("Missing 'Sync Sample Table' atom (stts)");
 
 	int32_t entries = stts->readInt(4);
+	if(entries < 0 || 8 + 8*int64_t(entries) > stts->contentSize())
+		throw string("Corrupt 'Sync Sample Table' atom (stts)");
+	vector<int32_t> table(2*size_t(entries));
+	stts->readInts(8, table.data(), table.size());
 
 	for(int i = 0; i < entries; i++) {
-		int32_t nsamples = stts->readInt( 8 + 8*i);
-		int32_t time     = stts->readInt(12 + 8*i);
+		int32_t nsamples = table[2*i];
+		int32_t time     = table[2*i + 1];
 		if(entries == 1) {
 			default_time = time;
 			break;
@@ -317,6 +381,7 @@ void Track::getKeyframes(Atom *t) {
 void Track::getSampleSizes(Atom *t) {
 	assert(t != NULL);
 	sample_sizes.clear();
+	reference_sizes = BigEndianTable<int32_t>();
 	// Chunk offsets.
 	Atom *stsz = t->atomByName("stsz");
 	if(!stsz)
@@ -326,8 +391,9 @@ void Track::getSampleSizes(Atom *t) {
 	default_size = stsz->readInt(4); 
 
 	if(default_size == 0) {
-		for(int i = 0; i < nsamples; i++)
-			sample_sizes.push_back(stsz->readInt(12 + 4*i));
+		if(nsamples < 0)
+			throw string("Corrupt 'Sample Sizes' atom (stsz)");
+		reference_sizes = stsz->table<int32_t>(12, nsamples);
 	}
 }
 
@@ -347,13 +413,22 @@ void Track::getChunkOffsets(Atom *t) {
 	if(nchunks == 0)
 		Log::debug << "Missing both 'Chunk Offset' atoms (stco & co64) or no chunks!";
 
+	Atom *table = stco ? stco : co64;
+	int entry_size = stco ? 4 : 8;
+	if(nchunks < 0 || (table && 8 + entry_size*int64_t(nchunks) > table->contentSize()))
+		throw string("Corrupt 'Chunk Offset' atom (stco/co64)");
+
 	chunks.resize(nchunks);
 	if(stco) {
+		vector<int32_t> offsets32(nchunks);
+		stco->readInts(8, offsets32.data(), nchunks);
 		for(int i = 0; i < nchunks; i++)
-			chunks[i].offset = stco->readUInt(8 + i*4);
-	} else {
+			chunks[i].offset = uint32_t(offsets32[i]);
+	} else if(nchunks) {
+		vector<int64_t> offsets64(nchunks);
+		co64->readInt64s(8, offsets64.data(), nchunks);
 		for(int i = 0; i < nchunks; i++)
-			chunks[i].offset = co64->readInt64(8 + i*8);
+			chunks[i].offset = offsets64[i];
 	}
 	return;
 }
@@ -394,7 +469,7 @@ void Track::getSampleToChunk(Atom *t){
 			} else {
 				uint64_t offset = chunks[k].offset;
 				for(int s = 0; s < chunks[k].nsamples; s++) {
-					int32_t size = sample_sizes[count++];
+					int32_t size = reference_sizes[count++];
 					chunks[k].size += size;
 					offsets.push_back(offset);
 					offset += size;
@@ -410,6 +485,26 @@ void Track::getSampleToChunk(Atom *t){
 }
 
 
+// Run length encoding for the sample tables: one run for each sequence of equal consecutive values.
+struct Run {
+	int first; //index of the first element (0 based).
+	int count;
+	int value;
+};
+
+template<class Value>
+static vector<Run> runLengths(size_t n, Value value) {
+	vector<Run> runs;
+	for(size_t i = 0; i < n; i++) {
+		int v = value(i);
+		if(!runs.empty() && runs.back().value == v)
+			runs.back().count++;
+		else
+			runs.push_back(Run{ int(i), 1, v });
+	}
+	return runs;
+}
+
 void Track::saveSampleTimes() {
 	if(!trak)
 		return;
@@ -417,21 +512,23 @@ void Track::saveSampleTimes() {
 	assert(stts);
 	if(!stts)
 		return;
-	int nentries = default_time? 1 : times.size();
-	stts->content.resize(4 +                //version
-						 4 +                //entries
-						 8*nentries);   //time table
-	stts->writeInt(nentries, 4);
-	if(default_time) {
-		//TODO
-		stts->writeInt(nsamples, 8);
-		stts->writeInt(default_time, 12);
-	} else {
-		for(unsigned int i = 0; i < times.size(); i++) {
-			stts->writeInt(1, 8 + 8*i);
-			stts->writeInt(times[i], 12 + 8*i);
-		}
+	vector<Run> runs;
+	if(default_time)
+		runs.push_back(Run{ 0, nsamples, default_time });
+	else
+		runs = runLengths(times.size(), [&](size_t i) { return times[i]; });
+
+	stts->contentResize(4 +                //version
+						4 +                //entries
+						8*runs.size());   //time table
+	stts->writeInt(runs.size(), 4);
+	vector<int32_t> table;
+	table.reserve(2*runs.size());
+	for(Run &run: runs) {
+		table.push_back(run.count);
+		table.push_back(run.value);
 	}
+	stts->writeInts(8, table.data(), table.size());
 }
 
 void Track::saveKeyframes() {
@@ -444,12 +541,14 @@ void Track::saveKeyframes() {
 	if(keyframes.empty())
 		return;
 
-	stss->content.resize(4 +                  //version
-						 4 +                  //entries
-						 4*keyframes.size()); //time table
+	stss->contentResize(4 +                  //version
+						4 +                  //entries
+						4*keyframes.size()); //time table
 	stss->writeInt(keyframes.size(), 4);
+	vector<int32_t> table(keyframes.size());
 	for(unsigned int i = 0; i < keyframes.size(); i++)
-		stss->writeInt(keyframes[i] + 1, 8 + 4*i);
+		table[i] = keyframes[i] + 1; //1 based
+	stss->writeInts(8, table.data(), table.size());
 }
 
 void Track::saveSampleSizes() {
@@ -460,18 +559,25 @@ void Track::saveSampleSizes() {
 	if(!stsz)
 		return;
 
-	stsz->content.resize(4 +                //version
-						 4 +                //default size
-						 4 +                //entries
-						 4*sample_sizes.size());   //size table
+	//all samples the same size: no need for the table.
+	int same_size = default_size;
+	if(!same_size && sample_sizes.size() &&
+			adjacent_find(sample_sizes.begin(), sample_sizes.end(), not_equal_to<int32_t>()) == sample_sizes.end())
+		same_size = sample_sizes[0];
+
+	stsz->contentResize(4 +                //version
+						4 +                //default size
+						4 +                //entries
+						(same_size ? 0 : 4*sample_sizes.size()));   //size table
 	stsz->writeInt(0, 4);
-	stsz->writeInt(default_size, 4);
+	stsz->writeInt(same_size, 4);
 	if(default_size) {
 		stsz->writeInt(nsamples, 8);
+	} else if(same_size) {
+		stsz->writeInt(sample_sizes.size(), 8);
 	} else {
 		stsz->writeInt(sample_sizes.size(), 8);
-		for(unsigned int i = 0; i < sample_sizes.size(); i++)
-			stsz->writeInt(sample_sizes[i], 12 + 4*i);
+		stsz->writeInts(12, sample_sizes.data(), sample_sizes.size());
 	}
 }
 
@@ -489,37 +595,42 @@ void Track::saveSampleToChunk() {
 	}
 
 	if(default_size == 0) { //video might put more samples in the same chunk, even a constant number, default_chunk_nsamples might be != 0
-		//TODO we should distinguish those cases.
-		//so if we don;t have a default number of samples per chunk we save one sample per chunk.
-		stsc->content.resize(4 +                //version
-							 4 +                //number of entries
-							 12);               //one sample per chunk.
-		stsc->writeInt(1,  4);
-		stsc->writeInt(1,  8);                  //first chunk (1 based)
-		stsc->writeInt(1, 12);                  //one sample per chunk
-		stsc->writeInt(1, 16);                  //id 1 (WHAT IS THIS!)
+		//samples per chunk from mergeChunks, otherwise we save one sample per chunk.
+		vector<Run> runs(1, Run{ 0, int(offsets.size()), 1 });
+		if(chunk_nsamples.size())
+			runs = runLengths(chunk_nsamples.size(), [&](size_t i) { return chunk_nsamples[i]; });
+		stsc->contentResize(4 +                //version
+							4 +                //number of entries
+							12*runs.size());   //one entry per run of chunks.
+		stsc->writeInt(runs.size(),  4);
+		for(unsigned int i = 0; i < runs.size(); i++) {
+			stsc->writeInt(runs[i].first + 1,  8 + 12*i);     //first chunk (1 based)
+			stsc->writeInt(runs[i].value, 12 + 12*i);
+			stsc->writeInt(1, 16 + 12*i);                  //id 1 (WHAT IS THIS!)
+		}
 	} else if(default_chunk_nsamples != 0) {
-		stsc->content.resize(4 +                //version
-							 4 +                //number of entries
-							 12);               //one sample per chunk.
+		stsc->contentResize(4 +                //version
+							4 +                //number of entries
+							12);               //one sample per chunk.
 		stsc->writeInt(1,  4);
 		stsc->writeInt(1,  8);                  //first chunk (1 based)
 		stsc->writeInt(default_chunk_nsamples, 12);                  //one sample per chunk
 		stsc->writeInt(1, 16);                  //id 1 (WHAT IS THIS!)
 
 	} else { //default size but not default chunk nsamples
-		stsc->content.resize(4 +                //version
-							 4 +                //number of entries
-							 12*chunk_sizes.size());               //one sample per chunk.
-		stsc->writeInt(chunk_sizes.size(),  4);
-		for(int i = 0; i < chunk_sizes.size(); i++) {
-			stsc->writeInt(i+1,  8 + 12*i);                  //first chunk (1 based)
-			int chunk_nsamples;
+		//a new entry only when the number of samples in the chunk changes.
+		vector<Run> runs = runLengths(chunk_sizes.size(), [&](size_t i) -> int {
 			if(codec.pcm)
-				chunk_nsamples = chunk_sizes[i]/ codec.pcm_bytes_per_sample;
-			else
-				chunk_nsamples = chunk_sizes[i]/ default_size;
-			stsc->writeInt(chunk_nsamples, 12 + 12*i);
+				return chunk_sizes[i]/ codec.pcm_bytes_per_sample;
+			return chunk_sizes[i]/ default_size;
+		});
+		stsc->contentResize(4 +                //version
+							4 +                //number of entries
+							12*runs.size());               //one entry per run of chunks.
+		stsc->writeInt(runs.size(),  4);
+		for(unsigned int i = 0; i < runs.size(); i++) {
+			stsc->writeInt(runs[i].first + 1,  8 + 12*i);     //first chunk (1 based)
+			stsc->writeInt(runs[i].value, 12 + 12*i);
 			stsc->writeInt(1, 16 + 12*i);                  //id 1 (WHAT IS THIS!)
 		}
 	}
@@ -528,26 +639,39 @@ void Track::saveSampleToChunk() {
 void Track::saveChunkOffsets() {
 	if(!trak)
 		return;
-	Atom *stco = trak->atomByName("stco");
-	if(stco) {
-		trak->prune("stco");
+	const char *keep = chunk_offsets64 ? "co64" : "stco";
+	const char *drop = chunk_offsets64 ? "stco" : "co64";
+	if(trak->atomByName(drop))
+		trak->prune(drop);
+
+	Atom *table = trak->atomByName(keep);
+	if(!table) {
 		Atom *stbl = trak->atomByName("stbl");
 		if(stbl) {
-			Atom *new_co64 = new Atom;
-			memcpy(new_co64->name, "co64", min(sizeof("co64"), sizeof(new_co64->name)-1));
-			stbl->children.push_back(new_co64);
+			table = new Atom;
+			memcpy(table->name, keep, min(sizeof("co64"), sizeof(table->name)-1));
+			stbl->addChild(table);
 		}
 	}
-	Atom *co64 = trak->atomByName("co64");
-	assert(co64);
-
-	co64->content.resize(4 +                //version
-						 4 +                //number of entries
-						 8*offsets.size());
-	co64->writeInt(0, 4);
-	co64->writeInt(offsets.size(), 4);
-	for(unsigned int i = 0; i < offsets.size(); i++)
-		co64->writeInt64(offsets[i], 8 + 8*i);
+	assert(table);
+	if(!table)
+		return;
+
+	int entry_size = chunk_offsets64 ? 8 : 4;
+	table->contentResize(4 +                //version
+						4 +                //number of entries
+						entry_size*offsets.size());
+	table->writeInt(0, 0);
+	table->writeInt(offsets.size(), 4);
+	if(chunk_offsets64) {
+		vector<int64_t> offsets64(offsets.begin(), offsets.end());
+		table->writeInt64s(8, offsets64.data(), offsets64.size());
+	} else {
+		vector<int32_t> offsets32(offsets.size());
+		for(unsigned int i = 0; i < offsets.size(); i++)
+			offsets32[i] = int32_t(uint32_t(offsets[i]));
+		table->writeInts(8, offsets32.data(), offsets32.size());
+	}
 }
 
 // vim:set ts=4 sw=4 sts=4 noet:
@@ -25,11 +25,64 @@
 
 #include <vector>
 #include <string>
+#include <iterator>
+#include <cstdint>
 
 
 #include "codec.h"
+#include "atom.h"
 
-class Atom;
+// Chunk offsets, stored as 32 bit values relative to a base as long as they fit,
+// switching to 64 bit storage for the whole table when one doesn't.
+class OffsetTable {
+public:
+	class const_iterator {
+	public:
+		typedef std::forward_iterator_tag iterator_category;
+		typedef int64_t value_type;
+		typedef ptrdiff_t difference_type;
+		typedef const int64_t *pointer;
+		typedef int64_t reference;
+
+		const_iterator(const OffsetTable *table, size_t i): table(table), i(i) {}
+		int64_t operator*() const { return (*table)[i]; }
+		const_iterator &operator++() { i++; return *this; }
+		bool operator==(const const_iterator &it) const { return i == it.i; }
+		bool operator!=(const const_iterator &it) const { return i != it.i; }
+	protected:
+		const OffsetTable *table;
+		size_t i;
+	};
+
+	size_t size() const { return wide.empty() ? narrow.size() : wide.size(); }
+	bool empty() const { return size() == 0; }
+	int64_t operator[](size_t i) const { return base + (wide.empty() ? int64_t(narrow[i]) : wide[i]); }
+	int64_t back() const { return (*this)[size() - 1]; }
+	const_iterator begin() const { return const_iterator(this, 0); }
+	const_iterator end() const { return const_iterator(this, size()); }
+
+	void push_back(int64_t offset) {
+		int64_t relative = offset - base;
+		if(wide.empty() && relative >= 0 && relative <= int64_t(UINT32_MAX))
+			narrow.push_back(uint32_t(relative));
+		else {
+			widen();
+			wide.push_back(relative);
+		}
+	}
+	void reserve(size_t n) { if(wide.empty()) narrow.reserve(n); else wide.reserve(n); }
+	void clear() { base = 0; narrow.clear(); wide.clear(); }
+	void swap(OffsetTable &t) { std::swap(base, t.base); narrow.swap(t.narrow); wide.swap(t.wide); }
+	void shift(int64_t delta) { base += delta; } //move all the offsets.
+	int64_t max() const;
+
+protected:
+	int64_t base = 0;
+	std::vector<uint32_t> narrow;
+	std::vector<int64_t>  wide;   //all the offsets once one doesn't fit narrow.
+
+	void widen();
+};
 
 class Track {
 public:
@@ -51,10 +104,13 @@ public:
 	int default_chunk_nsamples = 0;
 	int default_size = 0;  //default SAMPLE size (number of samples!!!!)
 	std::vector<int32_t> sample_sizes;   //SAMPLE sizes
+	BigEndianTable<int32_t> reference_sizes; //sample sizes of the working file, read in place from stsz.
 
 	//TODO use CHUNK instead!
 	std::vector<int32_t> chunk_sizes;
-	std::vector<int64_t> offsets; //CHUNK offsetspopulated only if not default size
+	std::vector<int32_t> chunk_nsamples; //samples in each chunk after mergeChunks, empty: one per chunk.
+	OffsetTable offsets; //CHUNK offsetspopulated only if not default size
+	bool chunk_offsets64 = true;  //save offsets in co64 instead of stco.
 
 	std::vector<int> keyframes; // 0 based!
 
@@ -75,8 +131,15 @@ public:
 	bool parse(Atom *trak);
 	void clear();
 	void writeToAtoms();
+	void saveChunkOffsets(); //only stco/co64, when just the offsets changed.
 	void fixTimes();
-	int getSize(size_t i) { if(sample_sizes.size()) return sample_sizes[i]; return default_size; }
+	void mergeChunks();
+	void reserve(size_t npackets); //before filling the tables in repair.
+	int getSize(size_t i) {
+		if(sample_sizes.size()) return sample_sizes[i];
+		if(reference_sizes.size()) return reference_sizes[i];
+		return default_size;
+	}
 	int getTimes(size_t i) { if(times.size()) return times[i]; return default_time; }
 
 protected:
@@ -93,7 +156,6 @@ protected:
 	void saveKeyframes();
 	void saveSampleSizes();
 	void saveSampleToChunk();
-	void saveChunkOffsets();
 };
 
 #endif // TRACK_H
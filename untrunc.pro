@@ -62,7 +62,7 @@ LIBS += ./libav/libavformat/libavformat.a \
 #LIBS += -L/usr/local/lib -lavformat -lavcodec -lavutil
 DEFINES += _FILE_OFFSET_BITS=64 VERBOSE VERBOSE1
 
-LIBS += -lz
+LIBS += -lz -lpthread
 
 #libbz2-dev e libz-dev for ubuntu.
 